@@ -0,0 +1,117 @@
+#pragma once
+
+#include "common.hpp"
+
+// 16KB, falls back to malloc when exhausted
+#define ARENA_SIZE 16384
+
+// Bump allocator for transient data of one action.
+// Arena blocks are not freed one by one, the whole arena goes away with the action's memory.
+// Blocks that fell back to malloc are freed as usual.
+namespace arena {
+  alignas(16) char buffer[ARENA_SIZE];
+  size_t used = 0;
+
+  void* allocate(size_t size, size_t align) {
+    size_t offset = (used + align - 1) & ~(align - 1);
+    if (offset + size > ARENA_SIZE) {
+      return malloc(size);
+    }
+    used = offset + size;
+    return buffer + offset;
+  };
+
+  void deallocate(void* p) {
+    char* c = static_cast<char*>(p);
+    if (c < buffer || c >= buffer + ARENA_SIZE) {
+      free(p);
+    }
+  };
+
+  template <typename T>
+  struct allocator {
+    typedef T value_type;
+
+    allocator() = default;
+
+    template <typename U>
+    allocator(const allocator<U>&) {}
+
+    T* allocate(size_t n) {
+      return static_cast<T*>(arena::allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t) {
+      arena::deallocate(p);
+    }
+
+    template <typename U>
+    bool operator==(const allocator<U>&) const { return true; }
+
+    template <typename U>
+    bool operator!=(const allocator<U>&) const { return false; }
+  };
+
+  // same wire format as std::vector, e.g. for inline action arguments
+  template <typename DataStream, typename T>
+  DataStream& operator<<(DataStream& ds, const std::vector<T, allocator<T>>& v) {
+    ds << unsigned_int(v.size());
+    for (const auto& i : v) {
+      ds << i;
+    }
+    return ds;
+  };
+}
+
+template <typename T>
+using arena_vector = std::vector<T, arena::allocator<T>>;
+
+// sorted vector of pairs, for the handful of keys one action touches
+template <typename KeyT, typename ValueT>
+class arena_map {
+  public:
+    typedef std::pair<KeyT, ValueT> value_type;
+    typedef typename arena_vector<value_type>::iterator iterator;
+    typedef typename arena_vector<value_type>::const_iterator const_iterator;
+
+    iterator begin() { return items.begin(); }
+    iterator end() { return items.end(); }
+    const_iterator begin() const { return items.begin(); }
+    const_iterator end() const { return items.end(); }
+    size_t size() const { return items.size(); }
+
+    iterator find(const KeyT& key) {
+      size_t i = lower_bound(key);
+      return i < items.size() && !(key < items[i].first) ? items.begin() + i : items.end();
+    }
+
+    const_iterator find(const KeyT& key) const {
+      size_t i = lower_bound(key);
+      return i < items.size() && !(key < items[i].first) ? items.begin() + i : items.end();
+    }
+
+    ValueT& operator[](const KeyT& key) {
+      size_t i = lower_bound(key);
+      if (i == items.size() || key < items[i].first) {
+        items.insert(items.begin() + i, value_type(key, ValueT()));
+      }
+      return items[i].second;
+    }
+
+  private:
+    arena_vector<value_type> items;
+
+    size_t lower_bound(const KeyT& key) const {
+      size_t lo = 0;
+      size_t hi = items.size();
+      while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (items[mid].first < key) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      return lo;
+    }
+};
@@ -36,13 +36,24 @@ asset double2asset(double a, symbol s) {
   return asset(int64_t(tmp), s);
 };
 
-template <typename KeyT, typename ValueT>
-ValueT get_or(std::map<KeyT, ValueT> m, KeyT key, ValueT default_value) {
-  auto itr = m.find(key);
-  if (itr != m.end()) {
-    return itr->second;
+// for the few elements sorted per action, much smaller code than std::sort
+template <typename Iterator, typename Less>
+void insertion_sort(Iterator first, Iterator last, Less less) {
+  if (first == last) return;
+  for (Iterator i = first + 1; i != last; i++) {
+    auto value = std::move(*i);
+    Iterator j = i;
+    while (j != first && less(value, *(j - 1))) {
+      *j = std::move(*(j - 1));
+      j--;
+    }
+    *j = std::move(value);
   }
-  return default_value;
+};
+
+template <typename Iterator>
+void insertion_sort(Iterator first, Iterator last) {
+  insertion_sort(first, last, [](const auto& a, const auto& b) { return a < b; });
 };
 
 uint32_t current_secs() {
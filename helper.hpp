@@ -13,9 +13,9 @@ struct abihash {
 };
 
 typedef eosio::multi_index<name("abihash"), abihash > abihash_tlb;
-abihash_tlb abihashs(name("eosio"), name("eosio").value);
 
 bool is_contract(name account) {
+  abihash_tlb abihashs(EOSIO, EOSIO.value);
   auto itr = abihashs.find(account.value);
   if (itr == abihashs.end()) return false;
   if (itr->hash == checksum256()) return false;  
@@ -81,10 +81,9 @@ struct rex_balance {
 };
 
 typedef eosio::multi_index<name("rexbal"), rex_balance> rexbal_tlb;
-rexbal_tlb rexbalances(EOSIO, EOSIO.value);
 
 rex_balance get_rexbalance(name account) {
-
+  rexbal_tlb rexbalances(EOSIO, EOSIO.value);
   auto itr = rexbalances.find(account.value);
   if(itr == rexbalances.end()){
     rex_balance rexbal;
@@ -110,4 +109,8 @@ struct rex_pool {
 };
 
 typedef eosio::multi_index<name("rexpool"), rex_pool> rexpool_tlb;
-rexpool_tlb rexpools(EOSIO, EOSIO.value);
+
+rex_pool get_rexpool() {
+  rexpool_tlb rexpools(EOSIO, EOSIO.value);
+  return rexpools.get(0, "rex pool not found");
+}
@@ -24,9 +24,12 @@ namespace pizzalend {
       _borrow_with_fee(from, get_first_receiver(), quantity, m);
     } else if (first == "bid") {
       _bid(from, get_first_receiver(), quantity, m);
+    } else if (first == "balance") {
+      _deposit_balance(from, get_first_receiver(), quantity);
     } else {
       check(false, "invalid memo");
     }
+    TRACE_PHASE(first.c_str());
   };
 
   void pizzalend::addpztoken(name pzname, extended_symbol pzsymbol, extended_symbol anchor, pztoken_config config) {
@@ -44,6 +47,8 @@ namespace pizzalend {
     pztokens.modify(itr, _self, [&](auto& row) {
       row.config = config;
     });
+    // liqdt_rate and max_ltv feed cached valuations
+    _bump_config_version();
 
     _calculate_interest(itr);
   };
@@ -77,13 +82,11 @@ namespace pizzalend {
 
     for (auto itr = pztokens.begin(); itr != pztokens.end(); itr++) {
       asset earn = itr->cal_discount_interest();
-      print_f("pz: %, earn: % | ", itr->pzname, earn);
+      TRACE_DEBUG("pz: %, earn: % | ", itr->pzname, earn);
       if (earn.amount < 0) {
-        print_f("warning!!! %'s earn is negative | ", itr->pzname);
+        TRACE_INFO("warning!!! %'s earn is negative | ", itr->pzname);
         continue;
       }
-      
-      check(earn.amount >= 0, "earn of " + itr->pzname.to_string() + " cannot be negative");
 
       asset got = earn;
       if (got > itr->available_deposit) {
@@ -92,7 +95,7 @@ namespace pizzalend {
 
       if (got.amount > 0) {
         _decr_pztoken_available_deposit(itr->pzname, got);
-        _transfer_out(KEEP_ACCOUNT, itr->anchor.get_contract(), got, "system income");
+        _accrue(KEEP_ACCOUNT, itr->anchor.get_contract(), got);
         auto earn_itr = earns.find(itr->pzname.value);
         if (earn_itr == earns.end()) {
           earn_itr = earns.emplace(_self, [&](auto& row) {
@@ -133,6 +136,24 @@ namespace pizzalend {
     while(litr != liqdtorders.end()) {
       litr = liqdtorders.erase(litr);
     }
+
+    colltotal_tlb colltotals(_self, _self.value);
+    auto titr = colltotals.begin();
+    while(titr != colltotals.end()) {
+      titr = colltotals.erase(titr);
+    }
+
+    stabledue_tlb dues(_self, _self.value);
+    auto ditr = dues.begin();
+    while(ditr != dues.end()) {
+      ditr = dues.erase(ditr);
+    }
+
+    stableclock_tlb clocks(_self, _self.value);
+    auto sitr = clocks.begin();
+    while(sitr != clocks.end()) {
+      sitr = clocks.erase(sitr);
+    }
   };
 
   void pizzalend::rmpztoken(name pzname) {
@@ -156,16 +177,88 @@ namespace pizzalend {
       rate_itr = pzrates.erase(rate_itr);
     }
     
+    stabledue_tlb dues(_self, _self.value);
+    auto dues_bypzdue = dues.get_index<name("bypzdue")>();
+    auto due_itr = dues_bypzdue.lower_bound((uint128_t)pzname.value << 64);
+    while (due_itr != dues_bypzdue.end() && due_itr->pzname == pzname) {
+      due_itr = dues_bypzdue.erase(due_itr);
+    }
+
+    stableclock_tlb clocks(_self, _self.value);
+    auto clock_itr = clocks.find(pzname.value);
+    if (clock_itr != clocks.end()) {
+      clocks.erase(clock_itr);
+    }
+
+    cachedstable_tlb cachedstables(_self, _self.value);
     auto stable_itr = cachedstables.find(pzname.value);
     if (stable_itr != cachedstables.end()) {
       cachedstables.erase(stable_itr);
     }
 
+    colltotal_tlb colltotals(_self, _self.value);
+    auto total_itr = colltotals.find(pzname.value);
+    if (total_itr != colltotals.end()) {
+      colltotals.erase(total_itr);
+    }
+
     auto itr = pztokens.find(pzname.value);
     if (itr != pztokens.end()) {
       pztokens.erase(itr);
     }
   };
+
+  void pizzalend::bulkload(name table, std::vector<std::vector<char>> rows) {
+    require_auth(_self);
+    check(rows.size() > 0, "empty rows");
+
+    // aggregates are rebuilt from the rows loaded so far, tables can be loaded in any order
+    uint64_t now = current_millis();
+    uint32_t count = 0;
+    if (table == name("pztokens")) {
+      count = _bulkload<pztoken_tlb, pztoken>(pztokens, rows, [&](pztoken& row) {
+        row.stable_weight = _sum_stable_weight(row.pzname);
+      });
+    } else if (table == name("collaterals")) {
+      count = _bulkload<collateral_tlb, collateral>(collaterals, rows, [&](collateral& row) {
+        _update_collateral_total(pztokens.get(row.pzname.value, "pztoken not found"), row.quantity, 1);
+        _count_position(row.account, true, 1);
+      });
+    } else if (table == name("loans")) {
+      count = _bulkload<loan_tlb, loan>(loans, rows, [&](loan& row) {
+        const pztoken& pz = pztokens.get(row.pzname.value, "pztoken not found");
+        if (row.type == BorrowType::Stable) {
+          _change_stable_weight(pz.pzname, 0, row.stable_weight());
+          _set_stable_due(row.id, pz, _remaining_countdown(row, pz, now), now);
+        }
+        _count_position(row.account, false, 1);
+      });
+    } else if (table == name("cachedhealth")) {
+      count = _bulkload<cached_health_tlb, cached_health>(cached_healths, rows, [&](cached_health& row) {
+        uint16_t collateral_count = 0;
+        auto collaterals_byacc = collaterals.get_index<name("byaccount")>();
+        for (auto itr = collaterals_byacc.lower_bound(row.account.value); itr != collaterals_byacc.end() && itr->account == row.account; itr++) {
+          collateral_count++;
+        }
+        uint16_t loan_count = 0;
+        auto loans_byacc = loans.get_index<name("byaccount")>();
+        for (auto itr = loans_byacc.lower_bound(row.account.value); itr != loans_byacc.end() && itr->account == row.account; itr++) {
+          loan_count++;
+        }
+        // values from another chain are never reused as is, the counts need the extensions before them
+        row.price_epoch = 0;
+        if (!row.loanable_value.has_value()) row.loanable_value = 0;
+        if (!row.exposures.has_value()) row.exposures = std::vector<health_exposure>();
+        row.collateral_count = collateral_count;
+        row.loan_count = loan_count;
+        if (row.config_version.has_value()) row.config_version = 0;
+        _update_histogram(nullptr, row.factor, row.loan_value);
+      });
+    } else {
+      check(false, "unsupported table");
+    }
+    TRACE_INFO("loaded % rows into % | ", count, table);
+  };
   #endif
 
   void pizzalend::redeem(name account, name pzcontract, asset pzquantity) {
@@ -177,7 +270,7 @@ namespace pizzalend {
   void pizzalend::redeemall(name account, name pzname) {
     require_auth(account);
 
-    pztoken pz = pztokens.get(pzname.value);
+    const pztoken& pz = pztokens.get(pzname.value);
     auto collaterals_byaccpzname = collaterals.get_index<name("byaccpzname")>();
     auto itr = collaterals_byaccpzname.find(raw(account, pzname));
     check(itr != collaterals_byaccpzname.end(), "insufficient redeemable quantity");
@@ -197,6 +290,32 @@ namespace pizzalend {
     _borrow(account, contract, quantity, type);
   };
 
+  void pizzalend::borrowbal(name account, name contract, asset quantity, uint8_t type) {
+    require_auth(account);
+
+    _borrow(account, contract, quantity, type, decimal(0, FLOAT), true);
+  };
+
+  void pizzalend::repaybal(name account, name contract, asset quantity) {
+    require_auth(account);
+
+    _repay(account, contract, quantity, true);
+  };
+
+  void pizzalend::collbal(name account, name contract, asset quantity) {
+    require_auth(account);
+
+    _collateral(account, contract, quantity, true);
+  };
+
+  void pizzalend::withdrawbal(name account, name contract, asset quantity) {
+    require_auth(account);
+    check(!_isblock(account, FEATURE_WITHDRAW), "account is blocked");
+
+    _debit_balance(account, contract, quantity);
+    _transfer_out(account, contract, quantity, "balance withdraw");
+  };
+
   void pizzalend::calinterest() {
     require_auth(permission_level{ACT_ACCOUNT, name("operator")});
 
@@ -219,94 +338,446 @@ namespace pizzalend {
   void pizzalend::cachehealth() {
     require_auth(permission_level{ACT_ACCOUNT, name("operator")});
 
-    std::map<name, simple_pztoken> pzs;
-    for (auto itr = pztokens.begin(); itr != pztokens.end(); itr++) {
-      _update_anchor_price(itr);
-      pzs[itr->pzname] = itr->simple();
-    }
-
-    std::map<name, double> accloans;
-    for (auto itr = loans.begin(); itr != loans.end(); itr++) {
-      auto pz = pzs.find(itr->pzname);
-      check(pz != pzs.end(), "simple pztoken not found");
-      simple_pztoken sp = pz->second;
-      double loan_value = sp.price * asset2double(itr->quantity);
-      auto accloan = accloans.find(itr->account);
-      if (accloan == accloans.end()) {
-        accloans[itr->account] = loan_value;
-      } else {
-        accloan->second += loan_value;
-      }
+    _refresh_prices();
+
+    histogram_deferred = true;
+
+    // loans are grouped by account in this index, each account is cached once
+    auto loans_byacc = loans.get_index<name("byaccount")>();
+    name last_account;
+    for (auto itr = loans_byacc.begin(); itr != loans_byacc.end(); itr++) {
+      if (itr->account == last_account) continue;
+      last_account = itr->account;
+      _cache_health(last_account);
+    }
+
+    histogram_deferred = false;
+    _rebuild_histogram();
+    _mark_prices_swept();
+    TRACE_PHASE("cachehealth");
+  };
+
+  void pizzalend::synctotal(name pzname) {
+    require_auth(permission_level{ACT_ACCOUNT, name("operator")});
+
+    const pztoken& pz = pztokens.get(pzname.value, "pztoken not found");
+    asset pzquantity = asset(0, pz.pzsymbol.get_symbol());
+    uint64_t accounts = 0;
+    auto collaterals_bypzname = collaterals.get_index<name("bypzname")>();
+    for (auto itr = collaterals_bypzname.lower_bound(pzname.value); itr != collaterals_bypzname.end() && itr->pzname == pzname; itr++) {
+      pzquantity += itr->quantity;
+      accounts++;
     }
 
-    for (auto itr = accloans.begin(); itr != accloans.end(); itr++) {
-      name account = itr->first;
-      double loan_value = itr->second;
-      double collateral_value = _cal_collateral_value(account);
-      double health_factor = collateral_value / loan_value;
-      _cache_health(account, loan_value, collateral_value, health_factor);
+    double value = decimal2double(pz.price) * pz.cal_pzprice() * asset2double(pzquantity);
+    colltotal_tlb colltotals(_self, _self.value);
+    auto itr = colltotals.find(pzname.value);
+    if (itr == colltotals.end()) {
+      colltotals.emplace(_self, [&](auto& row) {
+        row.pzname = pzname;
+        row.pzquantity = pzquantity;
+        row.value = value;
+        row.accounts = accounts;
+        row.updated_at = current_millis();
+      });
+    } else {
+      colltotals.modify(itr, _self, [&](auto& row) {
+        row.pzquantity = pzquantity;
+        row.value = value;
+        row.accounts = accounts;
+        row.updated_at = current_millis();
+      });
     }
   };
 
-  void pizzalend::uphealth() {
+  void pizzalend::uphealth(uint32_t budget) {
     require_auth(permission_level{ACT_ACCOUNT, name("operator")});
 
-    _uphealth();
+    _uphealth(0, budget);
   }
 
-  void pizzalend::uphealth2(double threshold) {
+  void pizzalend::uphealth2(double threshold, uint32_t budget) {
     require_auth(permission_level{ACT_ACCOUNT, name("operator")});
 
-    _uphealth(threshold);
+    _uphealth(threshold, budget);
   };
 
-  void pizzalend::_uphealth(double threshold) {
+  void pizzalend::_uphealth(double threshold, uint32_t budget) {
     require_auth(permission_level{ACT_ACCOUNT, name("operator")});
+    check(budget > 0, "budget must be positive");
+
+    bool updated = _refresh_prices();
+    _mark_prices_swept();
+    TRACE_PHASE("uphealth.prices");
+
+    // accounts exposed to a repriced token go first
+    exposure_tlb exposures(_self, _self.value);
+    for (auto eitr = exposures.begin(); eitr != exposures.end() && budget > 0; eitr++) {
+      if (eitr->pending_side != ExposureSide::NoSide) {
+        uint32_t marked = _mark_exposed(exposures, eitr, std::min(budget, (uint32_t)EXPOSURE_MARK_LIMIT));
+        budget -= _tick_cost(0, 0, marked, 0);
+      }
+    }
+
+    TRACE_PHASE("uphealth.exposure");
+
+    if (_refresh_dirty_healths(budget)) {
+      updated = true;
+    }
+    TRACE_PHASE("uphealth.dirty");
+
+    uint64_t start_cursor = _get_health_cursor();
+    uint64_t cursor = start_cursor;
+    if (_sweep_healths(threshold, cursor, budget)) {
+      updated = true;
+    }
+    // a sweep that only moved on still has to be kept, or the next call repeats it
+    if (cursor != start_cursor) {
+      updated = true;
+      _set_health_cursor(cursor);
+    }
+    TRACE_PHASE("uphealth.sweep");
 
+    check(updated, "nothing changed");
+  };
+
+  bool pizzalend::_refresh_dirty_healths(uint32_t& budget) {
     bool updated = false;
+    dirtyhealth_tlb dirtyhealths(_self, _self.value);
+    auto ditr = dirtyhealths.begin();
+    while (ditr != dirtyhealths.end() && budget > 0) {
+      budget--;
+      updated = true;
+      _refresh_health(ditr->account);
+      ditr = dirtyhealths.erase(ditr);
+      TRACE_COUNT(writes, 1);
+    }
+    return updated;
+  };
 
-    for (auto itr = pztokens.begin(); itr != pztokens.end(); itr++) {
-      if (_update_anchor_price(itr)) {
-        updated = true;
-      };
+  void pizzalend::_snapshot_healths(health_snapshot& snapshot) {
+    price_state state = _get_price_state();
+    snapshot.epoch = state.epoch;
+    snapshot.config_version = state.config_version;
+    snapshot.policy = _get_refresh_policy();
+    pricevol_tlb pricevols(_self, _self.value);
+    for (auto pitr = pztokens.begin(); pitr != pztokens.end(); pitr++) {
+      snapshot.prices[pitr->pzname] = pitr->price;
+      auto vitr = pricevols.find(pitr->pzname.value);
+      snapshot.vols[pitr->pzname] = vitr != pricevols.end() ? vitr->volatility : snapshot.policy.default_vol;
     }
+  };
+
+  bool pizzalend::_is_health_due(const cached_health& row, const health_snapshot& snapshot, uint64_t now, double threshold) {
+    if (!row.should_refresh(now, _cal_refresh_interval(row, snapshot.vols, snapshot.policy), threshold)) {
+      return false;
+    }
+    return !_is_provably_safe(row, snapshot, now);
+  };
 
+  bool pizzalend::_sweep_healths(double threshold, uint64_t& cursor, uint32_t& budget) {
+    health_snapshot snapshot;
+    _snapshot_healths(snapshot);
+
+    bool updated = false;
     auto now = current_millis();
-    auto itr = cached_healths.begin();
-    while (itr != cached_healths.end()) {
-      if (itr->should_refresh(now, threshold)) {
+    TRACE_COUNT(scans, 1);
+    auto itr = cached_healths.lower_bound(cursor);
+    while (itr != cached_healths.end() && budget > 0) {
+      budget--;
+      TRACE_COUNT(reads, 1);
+      if (_is_health_due(*itr, snapshot, now, threshold)) {
         updated = true;
         name account = itr->account;
-        double loan_value = _cal_loan_value(account);
-        if (loan_value <= 0) {
-          itr = cached_healths.erase(itr);
-          continue;
-        }
+        // step over the row first, _refresh_health may erase it
+        itr++;
+        _refresh_health(account);
+        continue;
+      }
+      itr++;
+    }
+    cursor = itr == cached_healths.end() ? 0 : itr->account.value;
+    return updated;
+  };
 
-        double collateral_value = _cal_collateral_value(account);
-        while (loan_value > 0 && collateral_value < loan_value) {
-          print_f("BOOM!!! acc: %, loan: %, collateral: % | ", account, loan_value, collateral_value);
-          _liqdt(account, loan_value);
-          collateral_value = _cal_collateral_value(account);
-          loan_value = _cal_loan_value(account);
-        }
+  work_estimate pizzalend::getwork(uint32_t limit) {
+    work_estimate work = {};
+    uint32_t now = current_secs();
 
-        if (loan_value <= 0) {
-          itr = cached_healths.erase(itr);
-          continue;
+    priceinfo_tlb priceinfos(_self, _self.value);
+    interestinfo_tlb interestinfos(_self, _self.value);
+    auto loans_bypzname = loans.get_index<name("bypzname")>();
+    uint32_t scanned_loans = 0;
+    for (auto itr = pztokens.begin(); itr != pztokens.end(); itr++) {
+      auto pinfo = priceinfos.find(itr->pzname.value);
+      bool pushed = pinfo != priceinfos.end() && pinfo->price_at + PRICE_PUSH_TTL > now;
+      if (!pushed && pizzafeed::get_price(itr->anchor) != itr->price) {
+        work.stale_prices.push_back(itr->pzname);
+      }
+
+      auto iinfo = interestinfos.find(itr->pzname.value);
+      if (iinfo != interestinfos.end() && iinfo->settled_at + INTEREST_INTERVAL > now) continue;
+      work.stale_interest.push_back(itr->pzname);
+      for (auto litr = loans_bypzname.lower_bound(itr->pzname.value); litr != loans_bypzname.end() && litr->pzname == itr->pzname && scanned_loans < limit; litr++) {
+        scanned_loans++;
+        work.interest_rows++;
+      }
+    }
+
+    exposure_tlb exposures(_self, _self.value);
+    for (auto itr = exposures.begin(); itr != exposures.end(); itr++) {
+      if (itr->pending_side == ExposureSide::NoSide) continue;
+      work.exposed_tokens++;
+      work.exposure_rows += _count_exposed(itr, limit - std::min(limit, work.exposure_rows));
+    }
+
+    dirtyhealth_tlb dirtyhealths(_self, _self.value);
+    for (auto itr = dirtyhealths.begin(); itr != dirtyhealths.end() && work.dirty_healths < limit; itr++) {
+      work.dirty_healths++;
+    }
+
+    auto hist = health_hists.find(0);
+    if (hist != health_hists.end() && !hist->buckets.empty()) {
+      work.below_one = hist->buckets[0].count;
+    }
+
+    health_snapshot snapshot;
+    _snapshot_healths(snapshot);
+    uint64_t now_millis = current_millis();
+    for (auto itr = cached_healths.lower_bound(_get_health_cursor()); itr != cached_healths.end() && work.scanned_healths < limit; itr++) {
+      work.scanned_healths++;
+      if (_is_health_due(*itr, snapshot, now_millis, 0)) work.due_healths++;
+    }
+
+    uint32_t token_count = snapshot.prices.size();
+    work.estimated_rows = _tick_cost(token_count, work.interest_rows, work.exposure_rows, work.dirty_healths + work.scanned_healths);
+    return work;
+  };
+
+  void pizzalend::tick(uint32_t budget) {
+    require_auth(permission_level{ACT_ACCOUNT, name("operator")});
+    check(budget > 0, "budget must be positive");
+
+    // pztoken rows are loaded once here, later steps reuse them from the table cache
+    _refresh_prices();
+    _mark_prices_swept();
+    TRACE_PHASE("tick.prices");
+
+    uint32_t now = current_secs();
+    interestinfo_tlb interestinfos(_self, _self.value);
+    for (auto itr = pztokens.begin(); itr != pztokens.end() && budget > 0; itr++) {
+      budget -= _tick_cost(1, 0, 0, 0);
+      auto info = interestinfos.find(itr->pzname.value);
+      if (info != interestinfos.end() && info->settled_at + INTEREST_INTERVAL > now) continue;
+      // a pztoken is settled as a whole, it may overrun the budget by its loan count
+      budget -= std::min(budget, _tick_cost(0, _calculate_interest(itr), 0, 0));
+    }
+    TRACE_PHASE("tick.interest");
+
+    exposure_tlb exposures(_self, _self.value);
+    for (auto eitr = exposures.begin(); eitr != exposures.end() && budget > 0; eitr++) {
+      if (eitr->pending_side != ExposureSide::NoSide) {
+        uint32_t marked = _mark_exposed(exposures, eitr, std::min(budget, (uint32_t)EXPOSURE_MARK_LIMIT));
+        budget -= _tick_cost(0, 0, marked, 0);
+      }
+    }
+    _refresh_dirty_healths(budget);
+    TRACE_PHASE("tick.dirty");
+
+    uint64_t cursor = _get_health_cursor();
+    _sweep_healths(0, cursor, budget);
+    TRACE_PHASE("tick.sweep");
+
+    _set_health_cursor(cursor);
+  };
+
+  static const double HEALTH_BUCKET_FLOORS[] = {0, 1, 1.1, 1.25, 1.5, 1.7, 2, 3};
+
+  static std::vector<health_bucket> empty_buckets() {
+    std::vector<health_bucket> buckets;
+    for (double floor : HEALTH_BUCKET_FLOORS) {
+      buckets.push_back(health_bucket{floor, 0, 0});
+    }
+    return buckets;
+  }
+
+  static health_bucket& find_bucket(std::vector<health_bucket>& buckets, double factor) {
+    size_t i = buckets.size() - 1;
+    while (i > 0 && factor < buckets[i].min_factor) i--;
+    return buckets[i];
+  }
+
+  void pizzalend::_update_histogram(const cached_health* removed, double factor, double loan_value) {
+    if (histogram_deferred) return;
+
+    auto itr = health_hists.find(0);
+    std::vector<health_bucket> buckets = itr != health_hists.end() ? itr->buckets : empty_buckets();
+
+    if (removed != nullptr) {
+      // rows cached before the histogram existed are not counted until cachehealth rebuilds it
+      health_bucket& bucket = find_bucket(buckets, removed->factor);
+      if (bucket.count > 0) bucket.count--;
+      bucket.loan_value = std::max(bucket.loan_value - removed->loan_value, 0.0);
+    }
+    if (loan_value > 0) {
+      health_bucket& bucket = find_bucket(buckets, factor);
+      bucket.count++;
+      bucket.loan_value += loan_value;
+    }
+
+    if (itr == health_hists.end()) {
+      health_hists.emplace(_self, [&](auto& row) {
+        row.buckets = buckets;
+        row.updated_at = current_millis();
+      });
+    } else {
+      health_hists.modify(itr, _self, [&](auto& row) {
+        row.buckets = buckets;
+        row.updated_at = current_millis();
+      });
+    }
+  };
+
+  void pizzalend::_rebuild_histogram() {
+    std::vector<health_bucket> buckets = empty_buckets();
+    for (auto itr = cached_healths.begin(); itr != cached_healths.end(); itr++) {
+      health_bucket& bucket = find_bucket(buckets, itr->factor);
+      bucket.count++;
+      bucket.loan_value += itr->loan_value;
+    }
+
+    auto itr = health_hists.find(0);
+    if (itr == health_hists.end()) {
+      health_hists.emplace(_self, [&](auto& row) {
+        row.buckets = buckets;
+        row.updated_at = current_millis();
+      });
+    } else {
+      health_hists.modify(itr, _self, [&](auto& row) {
+        row.buckets = buckets;
+        row.updated_at = current_millis();
+      });
+    }
+  };
+
+  void pizzalend::_refresh_health(name account) {
+    double loan_value = _cal_loan_value(account);
+    if (loan_value <= 0) {
+      _uncache_health(account);
+      return;
+    }
+
+    health_detail detail = _cal_health_detail(account);
+    while (detail.loan_value > 0 && detail.collateral_value < detail.loan_value) {
+      TRACE_INFO("BOOM!!! acc: %, loan: %, collateral: % | ", account, detail.loan_value, detail.collateral_value);
+      _liqdt(account, detail.loan_value);
+      detail = _cal_health_detail(account);
+    }
+
+    _cache_health(account, detail);
+  };
+
+  void pizzalend::_on_price_changed(name pzname, decimal old_price, decimal price) {
+    exposure_tlb exposures(_self, _self.value);
+    auto itr = exposures.find(pzname.value);
+    if (itr == exposures.end()) {
+      // positions only exist once a price is set, an unpriced token has nobody to mark
+      itr = exposures.emplace(_self, [&](auto& row) {
+        row.pzname = pzname;
+        row.marked_price = old_price;
+        row.pending_side = ExposureSide::NoSide;
+        row.cursor = 0;
+      });
+    }
+
+    double marked_price = decimal2double(itr->marked_price);
+    double move = marked_price > 0 ? decimal2double(price) / marked_price - 1 : 0;
+    if (move > -EXPOSURE_PRICE_MOVE && move < EXPOSURE_PRICE_MOVE) return;
+
+    exposures.modify(itr, _self, [&](auto& row) {
+      row.marked_price = price;
+      row.pending_side = move < 0 ? ExposureSide::CollateralSide : ExposureSide::LoanSide;
+      row.cursor = 0;
+    });
+    _mark_exposed(exposures, itr);
+  };
+
+  uint32_t pizzalend::_mark_exposed(exposure_tlb& exposures, exposure_tlb::const_iterator itr, uint32_t limit) {
+    name pzname = itr->pzname;
+    uint64_t cursor = itr->cursor;
+    uint32_t count = 0;
+    bool done = true;
+
+    if (itr->pending_side == ExposureSide::CollateralSide) {
+      auto collaterals_bypzname = collaterals.get_index<name("bypzname")>();
+      auto citr = collaterals_bypzname.lower_bound(pzname.value);
+      auto cursor_itr = collaterals.find(cursor);
+      if (cursor > 0 && cursor_itr != collaterals.end() && cursor_itr->pzname == pzname) {
+        citr = collaterals_bypzname.iterator_to(*cursor_itr);
+      }
+      while (citr != collaterals_bypzname.end() && citr->pzname == pzname) {
+        if (count >= limit) {
+          cursor = citr->id;
+          done = false;
+          break;
         }
-        double factor = collateral_value/loan_value;
-        cached_healths.modify(itr, _self, [&](auto& row) {
-          row.loan_value = loan_value;
-          row.collateral_value = collateral_value;
-          row.factor = factor;
-          row.updated_at = current_millis();
-        });
+        _mark_dirty(citr->account);
+        count++;
+        citr++;
+      }
+    } else if (itr->pending_side == ExposureSide::LoanSide) {
+      auto loans_bypzname = loans.get_index<name("bypzname")>();
+      auto litr = loans_bypzname.lower_bound(pzname.value);
+      auto cursor_itr = loans.find(cursor);
+      if (cursor > 0 && cursor_itr != loans.end() && cursor_itr->pzname == pzname) {
+        litr = loans_bypzname.iterator_to(*cursor_itr);
+      }
+      while (litr != loans_bypzname.end() && litr->pzname == pzname) {
+        if (count >= limit) {
+          cursor = litr->id;
+          done = false;
+          break;
+        }
+        _mark_dirty(litr->account);
+        count++;
+        litr++;
       }
-      itr++;
     }
 
-    check(updated, "nothing changed");
+    exposures.modify(itr, _self, [&](auto& row) {
+      row.pending_side = done ? ExposureSide::NoSide : row.pending_side;
+      row.cursor = done ? 0 : cursor;
+    });
+    return count;
+  };
+
+  uint32_t pizzalend::_count_exposed(exposure_tlb::const_iterator itr, uint32_t limit) {
+    name pzname = itr->pzname;
+    uint64_t cursor = itr->cursor;
+    uint32_t count = 0;
+
+    if (itr->pending_side == ExposureSide::CollateralSide) {
+      auto collaterals_bypzname = collaterals.get_index<name("bypzname")>();
+      auto citr = collaterals_bypzname.lower_bound(pzname.value);
+      auto cursor_itr = collaterals.find(cursor);
+      if (cursor > 0 && cursor_itr != collaterals.end() && cursor_itr->pzname == pzname) {
+        citr = collaterals_bypzname.iterator_to(*cursor_itr);
+      }
+      for (; citr != collaterals_bypzname.end() && citr->pzname == pzname && count < limit; citr++) {
+        count++;
+      }
+    } else if (itr->pending_side == ExposureSide::LoanSide) {
+      auto loans_bypzname = loans.get_index<name("bypzname")>();
+      auto litr = loans_bypzname.lower_bound(pzname.value);
+      auto cursor_itr = loans.find(cursor);
+      if (cursor > 0 && cursor_itr != loans.end() && cursor_itr->pzname == pzname) {
+        litr = loans_bypzname.iterator_to(*cursor_itr);
+      }
+      for (; litr != loans_bypzname.end() && litr->pzname == pzname && count < limit; litr++) {
+        count++;
+      }
+    }
+    return count;
   };
 
   void pizzalend::addallow(name account, name feature, uint32_t duration) {
@@ -356,17 +827,19 @@ namespace pizzalend {
 
     asset balance = get_eos_balance(WALLET_ACCOUNT);
 
-    pztoken pz = pztokens.get(name("pzeos").value, "pztoken not found");
+    const pztoken& pz = pztokens.get(name("pzeos").value, "pztoken not found");
 
-    auto rexpool = rexpools.find(0);
+    rex_pool rexpool = get_rexpool();
     auto rex_balance = get_rexbalance(WALLET_ACCOUNT);
 
-    double value = asset2double(rexpool->total_lendable) / asset2double(rexpool->total_rex) * asset2double(rex_balance.rex_balance);
+    double value = asset2double(rexpool.total_lendable) / asset2double(rexpool.total_rex) * asset2double(rex_balance.rex_balance);
     balance += double2asset(value, EOS_SYMBOL);
 
-    asset rex_fee = balance - pz.available_deposit;
+    // fees and income accrued but not swept yet and user balances are in custody too
+    extended_symbol eos = extended_symbol(EOS_SYMBOL, EOSIOTOKEN);
+    asset rex_fee = balance - pz.available_deposit - _get_accrued(eos) - _get_balance_total(eos);
 
-    print("rex fee -> ", rex_fee);
+    TRACE_INFO("rex fee -> % | ", rex_fee);
     check(asset2double(rex_fee) < 15000, "wrong rex fee");
 
     if (rex_fee.amount > 0){
@@ -374,8 +847,486 @@ namespace pizzalend {
     }
   }
 
+  std::vector<health_bucket> pizzalend::gethist() {
+    auto itr = health_hists.find(0);
+    if (itr == health_hists.end()) {
+      return empty_buckets();
+    }
+    return itr->buckets;
+  };
+
+  health_quote pizzalend::gethealth(name account) {
+    health_quote quote;
+    quote.account = account;
+    quote.loan_value = _cal_loan_value(account);
+    quote.collateral_value = _cal_collateral_value(account);
+    quote.loanable_collateral_value = _cal_loanable_collateral_value(account);
+    quote.factor = quote.loan_value > 0 ? quote.collateral_value/quote.loan_value : -1;
+    return quote;
+  };
+
+  borrow_quote pizzalend::getborrow(name account, name pzname) {
+    const pztoken& pz = pztokens.get(pzname.value, "pztoken not found");
+
+    borrow_quote quote;
+    quote.account = account;
+    quote.pzname = pzname;
+    quote.max_borrow = asset(0, pz.anchor.get_symbol());
+    quote.variable_rate = pz.floating_rate;
+    quote.stable_rate = pz.config.can_stable_borrow ? cal_fixed_rate(pz, 0, true) : decimal(0, FLOAT);
+
+    double price = decimal2double(pz.price);
+    if (price > 0) {
+      // same limits as _borrow: loanable collateral and defend list
+      double loan_value = _cal_loan_value(account);
+      double max_value = _cal_loanable_collateral_value(account) - loan_value;
+      max_value = std::min(max_value, _cal_defend_value(account) - loan_value);
+      if (max_value > 0) {
+        quote.max_borrow = double2asset(max_value / price, pz.anchor.get_symbol());
+      }
+      if (quote.max_borrow > pz.available_deposit) {
+        quote.max_borrow = pz.available_deposit;
+      }
+    }
+
+    quote.variable_fee = _cal_loan_fee(account, pz, quote.max_borrow, BorrowType::Variable, true);
+    quote.stable_fee = _cal_loan_fee(account, pz, quote.max_borrow, BorrowType::Stable, true);
+    return quote;
+  };
+
+  withdraw_quote pizzalend::getwithdraw(name account, name pzname) {
+    const pztoken& pz = pztokens.get(pzname.value, "pztoken not found");
+
+    withdraw_quote quote;
+    quote.account = account;
+    quote.pzname = pzname;
+    quote.max_withdraw = asset(0, pz.anchor.get_symbol());
+    quote.max_redeem = asset(0, pz.pzsymbol.get_symbol());
+
+    auto collaterals_byaccpzname = collaterals.get_index<name("byaccpzname")>();
+    auto itr = collaterals_byaccpzname.find(raw(account, pzname));
+    if (itr == collaterals_byaccpzname.end()) {
+      return quote;
+    }
+
+    asset max_redeem = itr->quantity;
+    asset max_withdraw = pz.cal_anchor_quantity(itr->quantity);
+
+    double price = decimal2double(pz.price);
+    double max_value = _cal_withdrawable_value(account, pz);
+    if (max_value >= 0 && price > 0) {
+      // same limits as _redeem and _withdraw
+      asset redeem_limit = double2asset(max_value / (price * pz.cal_pzprice()), pz.pzsymbol.get_symbol());
+      if (redeem_limit < max_redeem) max_redeem = redeem_limit;
+      asset withdraw_limit = double2asset(max_value / price, pz.anchor.get_symbol());
+      if (withdraw_limit < max_withdraw) max_withdraw = withdraw_limit;
+    }
+    if (max_withdraw > pz.available_deposit) {
+      max_withdraw = pz.available_deposit;
+    }
+
+    if (max_redeem.amount > 0) quote.max_redeem = max_redeem;
+    if (max_withdraw.amount > 0) quote.max_withdraw = max_withdraw;
+    return quote;
+  };
+
+  void pizzalend::refreshelig(std::vector<name> accounts) {
+    require_auth(permission_level{ACT_ACCOUNT, name("operator")});
+
+    for (auto itr = accounts.begin(); itr != accounts.end(); itr++) {
+      _get_eligibility(*itr, false, true);
+    }
+  };
+
+  void pizzalend::gc(uint32_t limit) {
+    require_auth(permission_level{ACT_ACCOUNT, name("operator")});
+    check(limit > 0, "limit must be positive");
+
+    gcstate_tlb gcstates(_self, _self.value);
+    gc_state state = {};
+    auto state_itr = gcstates.find(0);
+    if (state_itr != gcstates.end()) {
+      state = *state_itr;
+    }
+
+    dust_map dusts;
+    uint32_t budget = limit;
+    while (budget > 0) {
+      bool done = false;
+      if (state.category == GcCategory::DustCollateral) {
+        done = _gc_collaterals(state, budget, dusts);
+      } else if (state.category == GcCategory::DustLoan) {
+        done = _gc_loans(state, budget);
+      } else if (state.category == GcCategory::DrainedOrder) {
+        done = _gc_liqdtorders(state, budget, dusts);
+      } else if (state.category == GcCategory::ExpiredAllow) {
+        done = _gc_allowlist(state, budget);
+      } else if (state.category == GcCategory::ExpiredBlock) {
+        done = _gc_blocklist(state, budget);
+      } else {
+        done = _gc_eligibilities(state, budget);
+      }
+
+      if (!done) break;
+      state.category++;
+      state.scope_index = 0;
+      state.cursor = 0;
+      if (state.category >= GcCategory::GcCategoryCount) {
+        // a full pass per run at most
+        state.category = GcCategory::DustCollateral;
+        break;
+      }
+    }
+
+    for (auto itr = dusts.begin(); itr != dusts.end(); itr++) {
+      if (itr->second.amount > 0) {
+        _transfer_out(SAFU_ACCOUNT, itr->first.get_contract(), itr->second, "dust collateral");
+      }
+    }
+
+    state.updated_at = current_millis();
+    if (state_itr == gcstates.end()) {
+      gcstates.emplace(_self, [&](auto& row) {
+        row = state;
+      });
+    } else {
+      gcstates.modify(state_itr, _self, [&](auto& row) {
+        row = state;
+      });
+    }
+  };
+
+  bool pizzalend::_gc_collaterals(gc_state& state, uint32_t& budget, dust_map& dusts) {
+    auto itr = collaterals.lower_bound(state.cursor);
+    while (itr != collaterals.end() && budget > 0) {
+      budget--;
+      state.cursor = itr->id + 1;
+
+      const pztoken& pz = pztokens.get(itr->pzname.value);
+      if (pz.cal_anchor_quantity(itr->quantity).amount > 0) {
+        itr++;
+        continue;
+      }
+
+      // worth less than one unit of the anchor token
+      name account = itr->account;
+      asset quantity = _decr_collateral(account, pz, itr->quantity);
+      _add_dust(dusts, pz.pzsymbol, quantity);
+      state.dust_collaterals++;
+      itr = collaterals.lower_bound(state.cursor);
+    }
+    return itr == collaterals.end();
+  };
+
+  bool pizzalend::_gc_loans(gc_state& state, uint32_t& budget) {
+    auto itr = loans.lower_bound(state.cursor);
+    while (itr != loans.end() && budget > 0) {
+      budget--;
+      state.cursor = itr->id + 1;
+
+      if (itr->actual_quantity().amount > 0) {
+        itr++;
+        continue;
+      }
+
+      name account = itr->account;
+      if (itr->quantity.amount <= 0) {
+        // nothing to repay, _decr_loan only takes positive quantities
+        _invalidate_health(account);
+        _remove_stable_due(itr->id);
+        itr = loans.erase(itr);
+        _count_position(account, false, -1);
+        state.dust_loans++;
+        continue;
+      }
+
+      // less than one unit of the anchor token, written off at its actual size
+      const pztoken& pz = pztokens.get(itr->pzname.value);
+      asset residual = trans_asset(pz.anchor.get_symbol(), itr->quantity);
+      _decr_loan(account, pz, itr->quantity, true);
+      if (residual.amount > 0) {
+        _incr_baddebt(pz, residual);
+      }
+      state.dust_loans++;
+      itr = loans.lower_bound(state.cursor);
+    }
+    return itr == loans.end();
+  };
+
+  bool pizzalend::_gc_liqdtorders(gc_state& state, uint32_t& budget, dust_map& dusts) {
+    auto itr = liqdtorders.lower_bound(state.cursor);
+    while (itr != liqdtorders.end() && budget > 0) {
+      budget--;
+      state.cursor = itr->id + 1;
+
+      if (itr->loan.quantity.amount > 0) {
+        itr++;
+        continue;
+      }
+
+      // fully bid, only the rounding residual of collateral is left
+      if (itr->collateral.quantity.amount > 0) {
+        _add_dust(dusts, itr->collateral.get_extended_symbol(), itr->collateral.quantity);
+      }
+      itr = liqdtorders.erase(itr);
+      state.drained_orders++;
+    }
+    return itr == liqdtorders.end();
+  };
+
+  static const name GC_LIST_SCOPES[] = {ALL, FEATURE_DEPOSIT, FEATURE_WITHDRAW, FEATURE_BORROW, FEATURE_REPAY};
+  static const uint8_t GC_LIST_SCOPE_COUNT = sizeof(GC_LIST_SCOPES) / sizeof(GC_LIST_SCOPES[0]);
+
+  bool pizzalend::_gc_allowlist(gc_state& state, uint32_t& budget) {
+    uint64_t now = current_millis();
+    while (state.scope_index < GC_LIST_SCOPE_COUNT) {
+      allowlist_tlb allows(_self, GC_LIST_SCOPES[state.scope_index].value);
+      auto itr = allows.lower_bound(state.cursor);
+      while (itr != allows.end() && budget > 0) {
+        budget--;
+        state.cursor = itr->account.value + 1;
+        if (itr->expired_at > 0 && itr->expired_at <= now) {
+          itr = allows.erase(itr);
+          state.expired_lists++;
+        } else {
+          itr++;
+        }
+      }
+      if (itr != allows.end()) return false;
+
+      state.scope_index++;
+      state.cursor = 0;
+      if (budget == 0) return state.scope_index >= GC_LIST_SCOPE_COUNT;
+    }
+    return true;
+  };
+
+  bool pizzalend::_gc_blocklist(gc_state& state, uint32_t& budget) {
+    uint64_t now = current_millis();
+    while (state.scope_index < GC_LIST_SCOPE_COUNT) {
+      blocklist_tlb blocks(_self, GC_LIST_SCOPES[state.scope_index].value);
+      auto itr = blocks.lower_bound(state.cursor);
+      while (itr != blocks.end() && budget > 0) {
+        budget--;
+        state.cursor = itr->account.value + 1;
+        if (itr->expired_at > 0 && itr->expired_at <= now) {
+          itr = blocks.erase(itr);
+          state.expired_lists++;
+        } else {
+          itr++;
+        }
+      }
+      if (itr != blocks.end()) return false;
+
+      state.scope_index++;
+      state.cursor = 0;
+      if (budget == 0) return state.scope_index >= GC_LIST_SCOPE_COUNT;
+    }
+    return true;
+  };
+
+  bool pizzalend::_gc_eligibilities(gc_state& state, uint32_t& budget) {
+    uint64_t now = current_millis();
+    eligibility_tlb eligibilities(_self, _self.value);
+    auto itr = eligibilities.lower_bound(state.cursor);
+    while (itr != eligibilities.end() && budget > 0) {
+      budget--;
+      state.cursor = itr->account.value + 1;
+      if (itr->expired_at <= now) {
+        itr = eligibilities.erase(itr);
+        state.expired_eligibilities++;
+      } else {
+        itr++;
+      }
+    }
+    return itr == eligibilities.end();
+  };
+
+  static const name ACCRUAL_RECIPIENTS[] = {FEE_ACCOUNT, SAFU_ACCOUNT, KEEP_ACCOUNT};
+
+  void pizzalend::sweep(uint32_t limit) {
+    require_auth(permission_level{ACT_ACCOUNT, name("operator")});
+    check(limit > 0, "limit must be positive");
+
+    uint32_t count = 0;
+    for (const name& recipient : ACCRUAL_RECIPIENTS) {
+      accrual_tlb accruals(_self, recipient.value);
+      for (auto itr = accruals.begin(); itr != accruals.end() && count < limit; itr++) {
+        if (itr->quantity.quantity.amount <= 0) continue;
+
+        _transfer_out(recipient, itr->quantity.contract, itr->quantity.quantity, _accrual_memo(recipient));
+        _add_accrual(_self, itr->quantity.contract, -itr->quantity.quantity);
+        // keep the row, the next accrual of this token reuses it
+        accruals.modify(itr, _self, [&](auto& row) {
+          row.quantity.quantity.amount = 0;
+          row.updated_at = current_millis();
+        });
+        count++;
+      }
+    }
+
+    check(count > 0, "nothing to sweep");
+  };
+
+  void pizzalend::setposlimit(uint16_t max_collaterals, uint16_t max_loans) {
+    require_auth(permission_level{ADMIN_ACCOUNT, name("manager")});
+    check(max_collaterals > 0 && max_loans > 0, "limits must be positive");
+
+    poslimit_tlb poslimits(_self, _self.value);
+    auto itr = poslimits.find(0);
+    if (itr == poslimits.end()) {
+      poslimits.emplace(_self, [&](auto& row) {
+        row = position_limit{max_collaterals, max_loans};
+      });
+    } else {
+      poslimits.modify(itr, _self, [&](auto& row) {
+        row = position_limit{max_collaterals, max_loans};
+      });
+    }
+  };
+
+  void pizzalend::migrate(name table, uint8_t target_version, uint32_t limit) {
+    require_auth(permission_level{ACT_ACCOUNT, name("operator")});
+    check(limit > 0, "limit must be positive");
+
+    uint64_t now = current_millis();
+    migration_tlb migrations(_self, _self.value);
+    auto itr = migrations.find(table.value);
+    migration_state state = {table, 1, 1, 0, 0, 0, 0, 0};
+    if (itr != migrations.end()) {
+      state = *itr;
+    }
+    check(target_version == state.version + 1, "migrations run one version at a time");
+    if (state.target_version != target_version) {
+      state.target_version = target_version;
+      state.cursor = 0;
+      state.scanned = 0;
+      state.migrated = 0;
+      state.started_at = now;
+      state.completed_at = 0;
+    }
+
+    bool done = false;
+    uint64_t cursor = state.cursor;
+    uint32_t scanned = 0;
+    uint32_t migrated = 0;
+    if (table == name("cachedhealth") && target_version == 2) {
+      migrated = _migrate_cached_health(cursor, done, limit, scanned);
+    } else if (table == name("loans") && target_version == 2) {
+      migrated = _migrate_loans(cursor, done, limit, scanned);
+    } else {
+      check(false, "unknown migration");
+    }
+
+    state.scanned += scanned;
+    state.migrated += migrated;
+    state.cursor = cursor;
+    if (done) {
+      // readers gated on the version switch from here on
+      state.version = target_version;
+      state.completed_at = now;
+    }
+
+    if (itr == migrations.end()) {
+      migrations.emplace(_self, [&](auto& row) {
+        row = state;
+      });
+    } else {
+      migrations.modify(itr, _self, [&](auto& row) {
+        row = state;
+      });
+    }
+  };
+
+  uint32_t pizzalend::_migrate_cached_health(uint64_t& cursor, bool& done, uint32_t limit, uint32_t& scanned) {
+    uint32_t migrated = 0;
+    auto itr = cached_healths.lower_bound(cursor);
+    while (itr != cached_healths.end() && scanned < limit) {
+      scanned++;
+      if (itr->config_version.has_value()) {
+        itr++;
+        continue;
+      }
+      name account = itr->account;
+      // step over the row first, _cache_health may erase it
+      itr++;
+      _cache_health(account);
+      migrated++;
+    }
+    done = itr == cached_healths.end();
+    cursor = done ? 0 : itr->account.value;
+    return migrated;
+  };
+
+  void pizzalend::setrefresh(double sigmas, uint32_t min_interval, uint32_t max_interval, double vol_alpha, double default_vol) {
+    require_auth(permission_level{ACT_ACCOUNT, name("operator")});
+    check(sigmas > 0, "sigmas must be positive");
+    check(min_interval > 0 && min_interval <= max_interval, "invalid interval range");
+    check(vol_alpha > 0 && vol_alpha <= 1, "vol_alpha must be in (0, 1]");
+    check(default_vol > 0, "default_vol must be positive");
+
+    refreshpol_tlb refreshpols(_self, _self.value);
+    auto itr = refreshpols.find(0);
+    if (itr == refreshpols.end()) {
+      refreshpols.emplace(_self, [&](auto& row) {
+        row = refresh_policy{sigmas, min_interval, max_interval, vol_alpha, default_vol};
+      });
+    } else {
+      refreshpols.modify(itr, _self, [&](auto& row) {
+        row = refresh_policy{sigmas, min_interval, max_interval, vol_alpha, default_vol};
+      });
+    }
+  };
+
+  void pizzalend::setprices(std::vector<price_point> prices) {
+    if (!has_auth(FEED_ACCOUNT)) {
+      require_auth(permission_level{ACT_ACCOUNT, name("operator")});
+    }
+
+    priceinfo_tlb priceinfos(_self, _self.value);
+    auto pztokens_byanchor = pztokens.get_index<name("byanchor")>();
+
+    uint32_t now = current_secs();
+    bool changed = false;
+    for (auto itr = prices.begin(); itr != prices.end(); itr++) {
+      check(itr->price.symbol == FLOAT && itr->price.amount > 0, "invalid price");
+      // a future timestamp would outrank every feed push until it arrives
+      check(itr->timestamp <= now + PRICE_PUSH_SKEW, "price timestamp is in the future");
+      auto pz = pztokens_byanchor.find(raw(itr->anchor));
+      if (pz == pztokens_byanchor.end()) continue;
+
+      auto info = priceinfos.find(pz->pzname.value);
+      if (info != priceinfos.end() && info->price_at >= itr->timestamp) {
+        // stale
+        continue;
+      }
+
+      if (_set_anchor_price(pztokens.iterator_to(*pz), itr->price)) {
+        changed = true;
+      }
+
+      if (info == priceinfos.end()) {
+        priceinfos.emplace(_self, [&](auto& row) {
+          row.pzname = pz->pzname;
+          row.price_at = itr->timestamp;
+        });
+      } else {
+        priceinfos.modify(info, _self, [&](auto& row) {
+          row.price_at = itr->timestamp;
+        });
+      }
+    }
+
+    price_state state = _get_price_state();
+    if (changed) {
+      state.epoch++;
+    }
+    state.pushed_at = now;
+    _set_price_state(state);
+  };
+
   void pizzalend::_deposit(name account, name contract, asset quantity) {
-    pztoken pz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
+    const pztoken& pz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
     _check_feature(pz, account, FEATURE_DEPOSIT);
 
     asset pzquantity = pz.cal_pzquantity(quantity);
@@ -388,8 +1339,17 @@ namespace pizzalend {
     _log_deposit(account, pz.pzname, quantity, pzquantity);
   };
 
-  void pizzalend::_collateral(name account, name contract, asset quantity) {
-    pztoken pz = _get_pztoken_bysymbol(extended_symbol(quantity.symbol, contract));
+  void pizzalend::_deposit_balance(name account, name contract, asset quantity) {
+    // only anchors, the ledger is for lend operations
+    const pztoken& pz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
+    _check_feature(pz, account, FEATURE_DEPOSIT);
+
+    _credit_balance(account, contract, quantity);
+    _transfer_in(account, contract, quantity, "balance");
+  };
+
+  void pizzalend::_collateral(name account, name contract, asset quantity, bool from_balance) {
+    const pztoken& pz = _get_pztoken_bysymbol(extended_symbol(quantity.symbol, contract));
     _check_feature(pz, account, FEATURE_DEPOSIT);
     check(pz.config.is_collateral, "this symbol can not be collateral");
 
@@ -412,13 +1372,17 @@ namespace pizzalend {
 
     _incr_collateral(account, pz, pzquantity);
     
-    _transfer_in(account, contract, quantity, "collateral");
+    if (from_balance) {
+      _debit_balance(account, contract, quantity);
+    } else {
+      _transfer_in(account, contract, quantity, "collateral");
+    }
 
     _log_collateral(account, pz.pzname, anchor_quantity, pzquantity);
   };
 
   void pizzalend::_redeem(name account, name pzcontract, asset pzquantity) {
-    auto pz = _get_pztoken_bypzsymbol(extended_symbol(pzquantity.symbol, pzcontract));
+    const pztoken& pz = _get_pztoken_bypzsymbol(extended_symbol(pzquantity.symbol, pzcontract));
     auto collaterals_byaccpzname = collaterals.get_index<name("byaccpzname")>();
     auto itr = collaterals_byaccpzname.find(raw(account, pz.pzname));
     check(itr != collaterals_byaccpzname.end() && itr->quantity >= pzquantity, "insufficient redeemable quantity");
@@ -433,7 +1397,7 @@ namespace pizzalend {
 
     _transfer_out(account, pzcontract, pzquantity, "redeem");
 
-    _cache_health(account);
+    _defer_health(account);
 
     _log_redeem(account, pz.pzname, pzquantity);
   };
@@ -441,6 +1405,7 @@ namespace pizzalend {
   void pizzalend::collswap(name frompz, name topz, decimal rate, uint32_t limit, uint64_t start) {
     require_auth(_self);
 
+    // snapshots: _decr_loan below must see from_pz as it was before the deposit update
     pztoken from_pz = pztokens.get(frompz.value);
     double from_pzprice = from_pz.cal_pzprice();
     pztoken to_pz = pztokens.get(topz.value);
@@ -448,7 +1413,7 @@ namespace pizzalend {
 
     double swap_rate = from_pzprice * decimal2double(rate) / to_pzprice;
 
-    print_f("from pzprice: %, to pzprice: %, swap_rate: % | ", from_pzprice, to_pzprice, swap_rate);
+    TRACE_INFO("from pzprice: %, to pzprice: %, swap_rate: % | ", from_pzprice, to_pzprice, swap_rate);
 
     auto collaterals_bypzname = collaterals.get_index<name("bypzname")>();
     auto collateral_itr = collaterals_bypzname.lower_bound(frompz.value);
@@ -467,7 +1432,10 @@ namespace pizzalend {
       asset pzquantity = collateral_itr->quantity;
 
       destroy_pzquantity += pzquantity;
+      _update_collateral_total(from_pz, -pzquantity, -1);
       collateral_itr = collaterals_bypzname.erase(collateral_itr);
+      _count_position(account, true, -1);
+      _invalidate_health(account);
       _log_upcollateral(account, from_pz.pzname, asset(0, pzquantity.symbol), asset(0, from_pz.anchor.get_symbol()));
 
       double collateral_value = asset2double(pzquantity);
@@ -477,9 +1445,9 @@ namespace pizzalend {
         _incr_collateral(account, to_pz, to_pzquantity);
       }
 
-      _cache_health(account);
+      _defer_health(account);
 
-      print_f("account: %, from pzquantity: %, to pzquantity: % | ", account, pzquantity, to_pzquantity);
+      TRACE_DEBUG("account: %, from pzquantity: %, to pzquantity: % | ", account, pzquantity, to_pzquantity);
 
       count++;
       if (count >= limit) {
@@ -489,7 +1457,7 @@ namespace pizzalend {
 
     check(count > 0, "no collateral to swap");
 
-    print_f("destroy pzquantity: %, issue pzquantity: % | ", destroy_pzquantity, issue_pzquantity);
+    TRACE_INFO("destroy pzquantity: %, issue pzquantity: % | ", destroy_pzquantity, issue_pzquantity);
 
     asset decr_quantity = from_pz.cal_anchor_quantity(destroy_pzquantity);
     _update_pztoken_deposit(from_pz.pzname, -decr_quantity, -destroy_pzquantity);
@@ -502,11 +1470,11 @@ namespace pizzalend {
     _update_pztoken_deposit(to_pz.pzname, incr_quantity, issue_pzquantity);
     _issue_pzsymbol(WALLET_ACCOUNT, to_pz.pzsymbol.get_contract(), issue_pzquantity, "collateral swap");
 
-    print_f("destroy quantity: %, destroy loan: %, incr quantity: %", decr_quantity, decr_loan, incr_quantity);
+    TRACE_INFO("destroy quantity: %, destroy loan: %, incr quantity: % | ", decr_quantity, decr_loan, incr_quantity);
   };
 
   void pizzalend::_withdraw(name account, name contract, asset quantity) {
-    pztoken pz = _get_pztoken_bysymbol(extended_symbol(quantity.symbol, contract));
+    const pztoken& pz = _get_pztoken_bysymbol(extended_symbol(quantity.symbol, contract));
     _check_feature(pz, account, FEATURE_WITHDRAW);
 
     bool withdraw_pzsymbol = contract == pz.pzsymbol.get_contract();
@@ -536,12 +1504,12 @@ namespace pizzalend {
     _transfer_out(pz.pzsymbol.get_contract(), pz.pzsymbol.get_contract(), pzquantity, "withdraw");
     _transfer_out(account, pz.anchor.get_contract(), anchor_quantity, "withdraw");
 
-    _cache_health(account);
+    _defer_health(account);
     _log_withdraw(account, pz.pzname, anchor_quantity, pzquantity);
   }
 
   void pizzalend::_withdraw_pztoken(name account, name pzcontract, asset pzquantity) {
-    pztoken pz = _get_pztoken_bypzsymbol(extended_symbol(pzquantity.symbol, pzcontract));
+    const pztoken& pz = _get_pztoken_bypzsymbol(extended_symbol(pzquantity.symbol, pzcontract));
     _check_feature(pz, account, FEATURE_WITHDRAW);
     
     asset quantity = pz.cal_anchor_quantity(pzquantity);
@@ -556,18 +1524,19 @@ namespace pizzalend {
     _log_withdraw(account, pz.pzname, quantity, pzquantity);
   }
 
-  decimal pizzalend::_borrow(name account, name contract, asset quantity, uint8_t type, decimal fee_deduct) {
+  decimal pizzalend::_borrow(name account, name contract, asset quantity, uint8_t type, decimal fee_deduct, bool to_balance) {
     check(type == BorrowType::Stable || type == BorrowType::Variable, "unsupport borrow type");
 
-    pztoken pz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
+    const pztoken& pz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
     check(quantity <= pz.available_deposit, "insufficient loan amount");
     _check_feature(pz, account, FEATURE_BORROW);
     if (type == BorrowType::Stable) {
       check(pz.config.can_stable_borrow, "this symbol does not support stable borrow");
     }
     
-    double collateral_value = _cal_loanable_collateral_value(account);
-    double loan_value = _cal_loan_value(account);
+    acc_value acc = _cal_acc_value(account);
+    double collateral_value = acc.loanable_collateral_value;
+    double loan_value = acc.loan_value;
     double available_value = collateral_value - loan_value;
     double value = decimal2double(pz.price) * asset2double(quantity);
     check(value <= available_value, "insufficient available loan quantity");
@@ -587,23 +1556,27 @@ namespace pizzalend {
       }
     }
     if (fee.amount > 0) {
-      _transfer_out(FEE_ACCOUNT, contract, fee, "loan fee");
+      _accrue(FEE_ACCOUNT, contract, fee);
     }
 
     _incr_loan(account, pz, quantity, type);
 
     quantity -= fee;
     check(quantity.amount > 0, "loan quantity is too small");
-    _transfer_out(account, contract, quantity, "loan");
+    if (to_balance) {
+      _credit_balance(account, contract, quantity);
+    } else {
+      _transfer_out(account, contract, quantity, "loan");
+    }
 
-    _cache_health(account);
+    _defer_health(account);
 
     _log_borrow(account, pz.pzname, quantity, fee, type);
 
     return fee_refund;
   };
 
-  asset pizzalend::_cal_loan_fee(name account, pztoken pz, asset quantity, uint8_t type) {
+  asset pizzalend::_cal_loan_fee(name account, const pztoken& pz, asset quantity, uint8_t type, bool dry_run) {
     // No handling fee on Pizza Day on the 22nd of every month
     auto t = current_time();
     if (t.tm_mday == 22) {
@@ -614,8 +1587,7 @@ namespace pizzalend {
     decimal fee_rate = pz.config.fixed_fee_rate;
     if (type == BorrowType::Variable) {
       fee_rate = pz.config.floating_fee_rate;
-      uint64_t votes = votepower::get_votes(account);
-      if (votes >= 100000) {
+      if (_get_eligibility(account, dry_run).vote_tier >= VoteTier::FeeWaiver) {
         fee_rate.amount = 0;
       }
     } else if (type == BorrowType::Stable) {
@@ -636,7 +1608,7 @@ namespace pizzalend {
   void pizzalend::_borrow_with_fee(name account, name fee_contract, asset fee_quantity, memo m) {
     check(fee_contract == PIZZA_CONTRACT && fee_quantity.symbol == PIZZA, "only support PIZZA to deduct borrow fees");
 
-    pztoken pz = _get_pztoken_byanchor(extended_symbol(fee_quantity.symbol, fee_contract));
+    const pztoken& pz = _get_pztoken_byanchor(extended_symbol(fee_quantity.symbol, fee_contract));
     decimal fee_deduct = decimal(pz.price.amount * asset2double(fee_quantity) / 0.9, FLOAT);
 
     name contract = name(m.get(1));
@@ -658,15 +1630,19 @@ namespace pizzalend {
     }
   };
   
-  void pizzalend::_repay(name account, name contract, asset quantity) {
-    pztoken pz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
+  void pizzalend::_repay(name account, name contract, asset quantity, bool from_balance) {
+    const pztoken& pz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
     _check_feature(pz, account, FEATURE_REPAY);
 
     _decr_loan(account, pz, quantity);
 
-    _transfer_in(account, contract, quantity, "repay");
+    if (from_balance) {
+      _debit_balance(account, contract, quantity);
+    } else {
+      _transfer_in(account, contract, quantity, "repay");
+    }
 
-    _cache_health(account);
+    _defer_health(account);
 
     _log_repay(account, pz.pzname, quantity);
   };
@@ -674,7 +1650,7 @@ namespace pizzalend {
   void pizzalend::_mini_repay(name account, name contract, asset quantity, memo m) {
     check(contract == PIZZA_CONTRACT && quantity.symbol == PIZZA, "only support PIZZA to repay mini loans");
 
-    pztoken repay_pz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
+    const pztoken& repay_pz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
     double repay_value = decimal2double(repay_pz.price) * asset2double(quantity);
     check(repay_value <= 0.1, "mini debt repay quantity exceed 0.1000 EOS");
 
@@ -686,7 +1662,7 @@ namespace pizzalend {
       name pzname = name(m.get(i));
       i++;
 
-      pztoken pz = pztokens.get(pzname.value);
+      const pztoken& pz = pztokens.get(pzname.value);
       _check_feature(pz, account, FEATURE_REPAY);
       auto loans_byaccpzname = loans.get_index<name("byaccpzname")>();
       auto itr = loans_byaccpzname.find(raw(account, pz.pzname));
@@ -721,7 +1697,7 @@ namespace pizzalend {
     check(quantity.amount > 0, "mini debt repay quantity is too small");
     _transfer_to(SAFU_ACCOUNT, contract, quantity, "mini debt repay");
 
-    _cache_health(account);
+    _defer_health(account);
   };
 
   void pizzalend::_addpztoken(name pzname, extended_symbol pzsymbol, extended_symbol anchor, pztoken_config config) {
@@ -786,6 +1762,7 @@ namespace pizzalend {
     uint64_t now = current_millis();
 
     decimal usage_rate = pztoken_itr->cal_usage_rate();
+    _set_stable_speed(pztoken_itr->pzname, _turn_variable_speed(usage_rate), now);
     decimal floating_rate = pztoken_itr->cal_floating_rate();
     _record_pzrate(pztoken_itr->pzname, floating_rate);
     decimal discount_rate = pztoken_itr->cal_discount_rate(usage_rate);
@@ -793,8 +1770,9 @@ namespace pizzalend {
     double pzprice = pztoken_itr->cal_pzprice();
     double pzprice_rate = 0;
 
+    uint128_t stable_weight = pztoken_itr->stable_weight.has_value() ? pztoken_itr->stable_weight.value() : _sum_stable_weight(pztoken_itr->pzname);
     double variable_interest = decimal2double(floating_rate) * asset2double(pztoken_itr->variable_borrow);
-    double stable_interest = _get_stable_interest(pztoken_itr->pzname);
+    double stable_interest = (double)stable_weight / pow(10, FLOAT.precision()) / pow(10, pztoken_itr->borrow_sym().precision());
     double total_interest = variable_interest + stable_interest;
 
     asset total_supply = pztoken_itr->pzquantity;
@@ -809,6 +1787,7 @@ namespace pizzalend {
       row.pzprice = pzprice;
       row.pzprice_rate = pzprice_rate;
       row.updated_at = now;
+      row.stable_weight = stable_weight;
     });
   };
 
@@ -817,7 +1796,7 @@ namespace pizzalend {
     auto loans_byacc = loans.get_index<name("byaccount")>();
     auto itr = loans_byacc.lower_bound(account.value);
     while(itr != loans_byacc.end() && itr->account == account) {
-      pztoken pz = pztokens.get(itr->pzname.value);
+      const pztoken& pz = pztokens.get(itr->pzname.value);
       loan_value += decimal2double(pz.price) * asset2double(itr->quantity);
       itr++;
     }
@@ -829,7 +1808,7 @@ namespace pizzalend {
     auto collaterals_byacc = collaterals.get_index<name("byaccount")>();
     auto itr = collaterals_byacc.lower_bound(account.value);
     while(itr != collaterals_byacc.end() && itr->account == account) {
-      pztoken pz = pztokens.get(itr->pzname.value);
+      const pztoken& pz = pztokens.get(itr->pzname.value);
       decimal rate = pz.config.liqdt_rate;
       if (for_loan) {
         rate = pz.config.max_ltv;
@@ -840,6 +1819,92 @@ namespace pizzalend {
     return collateral_value;
   };
 
+  void pizzalend::_cal_collateral_values(name account, double& collateral_value, double& loanable_value) {
+    collateral_value = 0;
+    loanable_value = 0;
+    auto collaterals_byacc = collaterals.get_index<name("byaccount")>();
+    auto itr = collaterals_byacc.lower_bound(account.value);
+    while(itr != collaterals_byacc.end() && itr->account == account) {
+      const pztoken& pz = pztokens.get(itr->pzname.value);
+      double value = decimal2double(pz.price) * pz.cal_pzprice() * asset2double(itr->quantity);
+      collateral_value += value * decimal2double(pz.config.liqdt_rate);
+      loanable_value += value * decimal2double(pz.config.max_ltv);
+      itr++;
+    }
+  };
+
+  void pizzalend::_check_position_limit(name account, bool is_collateral) {
+    position_limit limit = _get_position_limit();
+    uint32_t max_count = is_collateral ? limit.max_collaterals : limit.max_loans;
+
+    // counts from the cached row, kept in step by _count_position
+    auto hitr = cached_healths.find(account.value);
+    if (hitr != cached_healths.end() && hitr->collateral_count.has_value() && hitr->loan_count.has_value()) {
+      uint32_t count = is_collateral ? hitr->collateral_count.value() : hitr->loan_count.value();
+      check(count < max_count, is_collateral ? "too many collateral positions" : "too many loan positions");
+      return;
+    }
+
+    // no loan or cached before the counters existed, count at most max_count rows
+    uint32_t count = 0;
+    if (is_collateral) {
+      auto collaterals_byacc = collaterals.get_index<name("byaccount")>();
+      for (auto itr = collaterals_byacc.lower_bound(account.value); itr != collaterals_byacc.end() && itr->account == account && count < max_count; itr++) {
+        count++;
+      }
+    } else {
+      auto loans_byacc = loans.get_index<name("byaccount")>();
+      for (auto itr = loans_byacc.lower_bound(account.value); itr != loans_byacc.end() && itr->account == account && count < max_count; itr++) {
+        count++;
+      }
+    }
+    check(count < max_count, is_collateral ? "too many collateral positions" : "too many loan positions");
+  };
+
+  pizzalend::health_detail pizzalend::_cal_health_detail(name account) {
+    health_detail detail;
+
+    TRACE_COUNT(scans, 2);
+    auto loans_byacc = loans.get_index<name("byaccount")>();
+    for (auto itr = loans_byacc.lower_bound(account.value); itr != loans_byacc.end() && itr->account == account; itr++) {
+      TRACE_COUNT(reads, 1);
+      const pztoken& pz = pztokens.get(itr->pzname.value);
+      double loan_value = decimal2double(pz.price) * asset2double(itr->quantity);
+      detail.loan_value += loan_value;
+      detail.add(pz.pzname, pz.price, 0, loan_value);
+      detail.loan_count++;
+      // variable rates can climb to base_rate + max_rate at full usage
+      double rate = itr->type == BorrowType::Stable ? decimal2double(itr->fixed_rate) : decimal2double(pz.config.base_rate) + decimal2double(pz.config.max_rate);
+      detail.max_rate = std::max(detail.max_rate, rate);
+    }
+
+    auto collaterals_byacc = collaterals.get_index<name("byaccount")>();
+    for (auto itr = collaterals_byacc.lower_bound(account.value); itr != collaterals_byacc.end() && itr->account == account; itr++) {
+      TRACE_COUNT(reads, 1);
+      const pztoken& pz = pztokens.get(itr->pzname.value);
+      double value = decimal2double(pz.price) * pz.cal_pzprice() * asset2double(itr->quantity);
+      double collateral_value = value * decimal2double(pz.config.liqdt_rate);
+      detail.collateral_value += collateral_value;
+      detail.loanable_value += value * decimal2double(pz.config.max_ltv);
+      detail.add(pz.pzname, pz.price, collateral_value, 0);
+      detail.collateral_count++;
+    }
+    return detail;
+  };
+
+  pizzalend::acc_value pizzalend::_cal_acc_value(name account) {
+    auto itr = cached_healths.find(account.value);
+    price_state state = _get_price_state();
+    if (itr != cached_healths.end() && itr->is_valued(state.epoch, state.config_version)) {
+      return acc_value(itr->loan_value, itr->collateral_value, itr->loanable_value.value());
+    }
+
+    acc_value value;
+    value.loan_value = _cal_loan_value(account);
+    _cal_collateral_values(account, value.collateral_value, value.loanable_collateral_value);
+    return value;
+  };
+
   double pizzalend::_cal_health_factor(name account) {
     double collateral_value = _cal_collateral_value(account);
     double loan_value = _cal_loan_value(account);
@@ -848,24 +1913,122 @@ namespace pizzalend {
   }
 
   bool pizzalend::_update_anchor_price(pztoken_tlb::const_iterator pztoken_itr) {
-    decimal price = pizzafeed::get_price(pztoken_itr->anchor);
+    return _set_anchor_price(pztoken_itr, pizzafeed::get_price(pztoken_itr->anchor));
+  };
+
+  bool pizzalend::_set_anchor_price(pztoken_tlb::const_iterator pztoken_itr, decimal price) {
     if (price != pztoken_itr->price) {
+      decimal old_price = pztoken_itr->price;
+      _record_price_move(pztoken_itr->pzname, old_price, price);
       pztokens.modify(pztoken_itr, _self, [&](auto& row) {
         row.price = price;
       });
+      _on_price_changed(pztoken_itr->pzname, old_price, price);
+      _update_collateral_total(*pztoken_itr, asset(0, pztoken_itr->pzsymbol.get_symbol()), 0);
       return true;
     }
     return false;
   };
 
+  void pizzalend::_record_price_move(name pzname, decimal old_price, decimal new_price) {
+    if (old_price.amount <= 0) return;
+    double move = fabs(decimal2double(new_price) / decimal2double(old_price) - 1);
+    uint32_t now = current_secs();
+
+    pricevol_tlb pricevols(_self, _self.value);
+    auto itr = pricevols.find(pzname.value);
+    if (itr == pricevols.end()) {
+      // first move, no interval to scale by yet
+      pricevols.emplace(_self, [&](auto& row) {
+        row.pzname = pzname;
+        row.volatility = _get_refresh_policy().default_vol;
+        row.moved_at = now;
+      });
+      return;
+    }
+
+    // moves closer than a minute apart are scaled as one minute
+    double hours = std::max(now - std::min(now, itr->moved_at), (uint32_t)60) / 3600.0;
+    double sample = move / sqrt(hours);
+    double alpha = _get_refresh_policy().vol_alpha;
+    pricevols.modify(itr, _self, [&](auto& row) {
+      row.volatility += alpha * (sample - row.volatility);
+      row.moved_at = now;
+    });
+  };
+
+  uint32_t pizzalend::_cal_refresh_interval(const cached_health& row, const arena_map<name, double>& vols, const refresh_policy& policy) {
+    uint32_t tier = _tier_refresh_interval(row.factor);
+    if (row.factor <= 1) return std::min(policy.min_interval, tier);
+
+    // value weighted volatility of the account's tokens, the riskiest token without a breakdown
+    double vol = 0;
+    if (row.exposures.has_value() && !row.exposures->empty()) {
+      double total = 0;
+      for (auto itr = row.exposures->begin(); itr != row.exposures->end(); itr++) {
+        auto vitr = vols.find(itr->pzname);
+        double token_vol = vitr != vols.end() ? vitr->second : policy.default_vol;
+        double value = itr->collateral_value + itr->loan_value;
+        vol += token_vol * value;
+        total += value;
+      }
+      vol = total > 0 ? vol / total : policy.default_vol;
+    } else {
+      for (auto itr = vols.begin(); itr != vols.end(); itr++) {
+        vol = std::max(vol, itr->second);
+      }
+      if (vol <= 0) vol = policy.default_vol;
+    }
+    if (vol <= 0) return std::min(policy.max_interval, tier);
+
+    // adverse relative move that takes the factor down to 1.0
+    double margin = 1 - 1 / row.factor;
+    double hours = pow(margin / (policy.sigmas * vol), 2);
+    double secs = hours * 3600;
+    uint32_t interval = policy.max_interval;
+    if (secs <= policy.min_interval) {
+      interval = policy.min_interval;
+    } else if (secs < policy.max_interval) {
+      interval = (uint32_t)secs;
+    }
+    // low volatility never stretches an account past its old tier
+    return std::min(interval, tier);
+  };
+
+  bool pizzalend::_refresh_prices() {
+    price_state state = _get_price_state();
+    uint32_t now = current_secs();
+    bool pushed = state.pushed_at + PRICE_PUSH_TTL > now;
+    priceinfo_tlb priceinfos(_self, _self.value);
+
+    bool changed = false;
+    for (auto itr = pztokens.begin(); itr != pztokens.end(); itr++) {
+      if (pushed) {
+        // only poll the tokens that setprices did not cover
+        auto info = priceinfos.find(itr->pzname.value);
+        if (info != priceinfos.end() && info->price_at + PRICE_PUSH_TTL > now) continue;
+      }
+      if (_update_anchor_price(itr)) {
+        changed = true;
+      }
+    }
+
+    if (changed) {
+      state.epoch++;
+      _set_price_state(state);
+    }
+    return state.epoch != state.swept_epoch;
+  };
+
   decimal pizzalend::_get_anchor_price(name pzname) {
-    pztoken pz = pztokens.get(pzname.value, "pztoken not found");
+    const pztoken& pz = pztokens.get(pzname.value, "pztoken not found");
     check(pz.price.amount > 0, "pztoken price not found");
     return pz.price;
   };
 
-  void pizzalend::_settle_pending_interest(pztoken_tlb::const_iterator pztoken_itr) {
+  uint32_t pizzalend::_settle_pending_interest(pztoken_tlb::const_iterator pztoken_itr) {
     uint64_t now = current_millis();
+    uint32_t count = 0;
 
     symbol borrow_sym = pztoken_itr->borrow_sym();
 
@@ -874,11 +2037,15 @@ namespace pizzalend {
     asset variable_borrow = asset(0, borrow_sym);
     asset stable_borrow = asset(0, borrow_sym);
 
-    double stable_interest = 0;
+    uint128_t stable_weight = 0;
+    bool indexed = _get_table_version(name("loans")) >= 2;
+    stabledue_tlb dues(_self, _self.value);
+    uint64_t clock = indexed ? _read_stable_clock(pztoken_itr->pzname, now) : 0;
 
     auto loans_bypzname = loans.get_index<name("bypzname")>();
     for(auto loan_itr = loans_bypzname.lower_bound(pztoken_itr->pzname.value); 
       loan_itr != loans_bypzname.end() && loan_itr->pzname == pztoken_itr->pzname; loan_itr++) {
+      count++;
       decimal rate = loan_itr->type == BorrowType::Stable ? loan_itr->fixed_rate : pztoken_itr->floating_rate;
 
       asset interest = loan_itr->cal_pending_interest(rate);
@@ -889,10 +2056,16 @@ namespace pizzalend {
         if (pztoken_itr->usage_rate >= TURN_VARIABLE_ACCELERATE_USAGE_RATE) {
           pass_millis *= TURN_VARIABLE_ACCELERATE;
         }
+        auto due_itr = indexed && loan_itr->type == BorrowType::Stable ? dues.find(loan_itr->id) : dues.end();
         loans_bypzname.modify(loan_itr, _self, [&](auto& row) {
           row.quantity += interest;
           row.last_calculated_at = now;
-          if (row.type == BorrowType::Stable) {
+          // once every stable loan has a due entry, conversions come from stabledue
+          // and the countdown on the row is only kept in step for readers of the table
+          if (due_itr != dues.end()) {
+            row.turn_variable_countdown = due_itr->due > clock ? due_itr->due - clock : 0;
+          }
+          if (!indexed && row.type == BorrowType::Stable) {
             if (pass_millis < row.turn_variable_countdown) {
               row.turn_variable_countdown -= pass_millis;
             } else {
@@ -906,49 +2079,116 @@ namespace pizzalend {
 
       if (loan_itr->type == BorrowType::Stable) {
         stable_borrow += loan_itr->quantity;
-        stable_interest += decimal2double(loan_itr->fixed_rate) * asset2double(loan_itr->quantity);
+        stable_weight += loan_itr->stable_weight();
       } else if (loan_itr->type == BorrowType::Variable) {
         variable_borrow += loan_itr->quantity;
       }
     }
 
-    _cache_stable(pztoken_itr->pzname, stable_interest);
+    if (indexed) {
+      _convert_due_loans(pztoken_itr->pzname, now, stable_borrow, variable_borrow, stable_weight);
+    }
+
+    cachedstable_tlb cachedstables(_self, _self.value);
+    auto stable_itr = cachedstables.find(pztoken_itr->pzname.value);
+    if (stable_itr != cachedstables.end()) {
+      cachedstables.erase(stable_itr);
+    }
+    if (added_interest.amount > 0) {
+      // loan quantities grew, cached valuations are stale
+      _bump_price_epoch();
+    }
 
     pztokens.modify(pztoken_itr, _self, [&](auto& row) {
       row.borrow = stable_borrow + variable_borrow;
       // no more accumulate
       row.variable_borrow = variable_borrow;
       row.stable_borrow = stable_borrow;
+      row.stable_weight = stable_weight;
     });
     _recal_pztoken(pztoken_itr);
+    return count;
   };
 
-  void pizzalend::_calculate_interest(pizzalend::pztoken_tlb::const_iterator pztoken_itr) {
+  void pizzalend::_convert_due_loans(name pzname, uint64_t now, asset& stable_borrow, asset& variable_borrow, uint128_t& stable_weight) {
+    stabledue_tlb dues(_self, _self.value);
+    auto dues_bypzdue = dues.get_index<name("bypzdue")>();
+    uint64_t clock = _read_stable_clock(pzname, now);
+    auto itr = dues_bypzdue.lower_bound((uint128_t)pzname.value << 64);
+    while (itr != dues_bypzdue.end() && itr->pzname == pzname && itr->due <= clock) {
+      auto loan_itr = loans.find(itr->loan_id);
+      if (loan_itr != loans.end() && loan_itr->type == BorrowType::Stable) {
+        stable_borrow -= loan_itr->quantity;
+        variable_borrow += loan_itr->quantity;
+        stable_weight -= loan_itr->stable_weight();
+        loans.modify(loan_itr, _self, [&](auto& row) {
+          row.turn_variable_countdown = 0;
+          row.type = BorrowType::Variable;
+          row.fixed_rate.amount = 0;
+        });
+      }
+      itr = dues_bypzdue.erase(itr);
+    }
+  };
+
+  uint32_t pizzalend::_migrate_loans(uint64_t& cursor, bool& done, uint32_t limit, uint32_t& scanned) {
     uint64_t now = current_millis();
+    stabledue_tlb dues(_self, _self.value);
+    uint32_t migrated = 0;
+    auto itr = loans.lower_bound(cursor);
+    while (itr != loans.end() && scanned < limit) {
+      scanned++;
+      if (itr->type == BorrowType::Stable && dues.find(itr->id) == dues.end()) {
+        const pztoken& pz = pztokens.get(itr->pzname.value, "pztoken not found");
+        _set_stable_due(itr->id, pz, _remaining_countdown(*itr, pz, now), now);
+        migrated++;
+      }
+      itr++;
+    }
+    done = itr == loans.end();
+    cursor = done ? 0 : itr->id;
+    return migrated;
+  };
 
-    _settle_pending_interest(pztoken_itr);
+  uint32_t pizzalend::_calculate_interest(pizzalend::pztoken_tlb::const_iterator pztoken_itr) {
+    uint32_t count = _settle_pending_interest(pztoken_itr);
     _log_upborrows(pztoken_itr->pzname);
+
+    interestinfo_tlb interestinfos(_self, _self.value);
+    auto info = interestinfos.find(pztoken_itr->pzname.value);
+    if (info == interestinfos.end()) {
+      interestinfos.emplace(_self, [&](auto& row) {
+        row.pzname = pztoken_itr->pzname;
+        row.settled_at = current_secs();
+      });
+    } else {
+      interestinfos.modify(info, _self, [&](auto& row) {
+        row.settled_at = current_secs();
+      });
+    }
+    return count;
   };
 
-  void pizzalend::_check_feature(pizzalend::pztoken pz, name account, name fname) {
+  void pizzalend::_check_feature(const pizzalend::pztoken& pz, name account, name fname) {
     check(!_isblock(account, fname), "account is blocked");
 
     check(pz.price.amount > 0, "pztoken price not set");
     feature_tlb features(_self, fname.value);
     auto perm = features.find(pz.pzname.value);
-    std::string msg = pz.pzname.to_string() + "'s " + fname.to_string() + " feature is closed";
-    check(perm != features.end() && perm->is_open, msg.c_str());
+    if (perm == features.end() || !perm->is_open) {
+      check(false, pz.pzname.to_string() + "'s " + fname.to_string() + " feature is closed");
+    }
   };
 
   void pizzalend::_liqdt(name account, double remain_loan_value) {
     double liqdt_loan_value = remain_loan_value / 2;
 
-    std::vector<loan> accloans = _get_accloans_byliqdt(account);
-    std::vector<collateral> acccollaterals = _get_acccollaterals_byliqdt(account);
+    arena_vector<loan> accloans = _get_accloans_byliqdt(account);
+    arena_vector<collateral> acccollaterals = _get_acccollaterals_byliqdt(account);
     auto citr = acccollaterals.begin();
     
     for (auto itr = accloans.begin(); itr != accloans.end() && liqdt_loan_value > 0; itr++) {
-      pztoken pz = pztokens.get(itr->pzname.value);
+      const pztoken& pz = pztokens.get(itr->pzname.value);
       asset loan_quantity = itr->actual_quantity();
       double loan_value = decimal2double(pz.price) * asset2double(loan_quantity);
       if (loan_value <= liqdt_loan_value) {
@@ -974,7 +2214,7 @@ namespace pizzalend {
           continue;
         }
 
-        pztoken cpz = pztokens.get(citr->pzname.value);
+        const pztoken& cpz = pztokens.get(citr->pzname.value);
         double liqdt_bonus = decimal2double(cpz.config.liqdt_bonus);
         double cprice = decimal2double(cpz.price) * cpz.cal_pzprice()/(1+liqdt_bonus);
         double collateral_value = cprice * asset2double(collateral_quantity);
@@ -1023,33 +2263,33 @@ namespace pizzalend {
     }
   };
 
-  std::vector<pizzalend::loan> pizzalend::_get_accloans_byliqdt(name account) {
-    std::vector<pizzalend::loan> accloans;
+  arena_vector<pizzalend::loan> pizzalend::_get_accloans_byliqdt(name account) {
+    arena_vector<pizzalend::loan> accloans;
     auto loans_byacc = loans.get_index<name("byaccount")>();
     auto itr = loans_byacc.lower_bound(account.value);
     while(itr != loans_byacc.end() && itr->account == account) {
       accloans.push_back(*itr);
       itr++;
     }
-    std::sort(accloans.begin(), accloans.end(), [this](loan l1, loan l2) {
-      pztoken pz1 = pztokens.get(l1.pzname.value);
-      pztoken pz2 = pztokens.get(l2.pzname.value);
+    insertion_sort(accloans.begin(), accloans.end(), [this](const loan& l1, const loan& l2) {
+      const pztoken& pz1 = pztokens.get(l1.pzname.value);
+      const pztoken& pz2 = pztokens.get(l2.pzname.value);
       return pz1.config.borrow_liqdt_order < pz2.config.borrow_liqdt_order;
     });
     return accloans;
   };
 
-  std::vector<pizzalend::collateral> pizzalend::_get_acccollaterals_byliqdt(name account) {
-    std::vector<collateral> acccollaterals;
+  arena_vector<pizzalend::collateral> pizzalend::_get_acccollaterals_byliqdt(name account) {
+    arena_vector<collateral> acccollaterals;
     auto collaterals_byacc = collaterals.get_index<name("byaccount")>();
     auto itr = collaterals_byacc.lower_bound(account.value);
     while(itr != collaterals_byacc.end() && itr->account == account) {
       acccollaterals.push_back(*itr);
       itr++;
     }
-    std::sort(acccollaterals.begin(), acccollaterals.end(), [this](collateral c1, collateral c2) {
-      pztoken pz1 = pztokens.get(c1.pzname.value);
-      pztoken pz2 = pztokens.get(c2.pzname.value);
+    insertion_sort(acccollaterals.begin(), acccollaterals.end(), [this](const collateral& c1, const collateral& c2) {
+      const pztoken& pz1 = pztokens.get(c1.pzname.value);
+      const pztoken& pz2 = pztokens.get(c2.pzname.value);
       return pz1.config.collateral_liqdt_order < pz2.config.collateral_liqdt_order;
     });
     return acccollaterals;
@@ -1066,7 +2306,7 @@ namespace pizzalend {
       "insufficient available bid quantity"
     );
 
-    pztoken pz = _get_pztoken_byanchor(itr->loan.get_extended_symbol());
+    const pztoken& pz = _get_pztoken_byanchor(itr->loan.get_extended_symbol());
     name got_contract = itr->collateral.contract;
     asset got = asset(0, itr->collateral.quantity.symbol);
     if (itr->loan.quantity > quantity) {
@@ -1086,9 +2326,9 @@ namespace pizzalend {
     _transfer_in(account, contract, quantity, "bid");
     _transfer_out(account, got_contract, got, "bid");
 
-    pztoken bpz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
+    const pztoken& bpz = _get_pztoken_byanchor(extended_symbol(quantity.symbol, contract));
     decimal bid_value = decimal(bpz.price.amount * asset2double(quantity), FLOAT);
-    pztoken gpz = _get_pztoken_bypzsymbol(extended_symbol(got.symbol, got_contract));
+    const pztoken& gpz = _get_pztoken_bypzsymbol(extended_symbol(got.symbol, got_contract));
     decimal got_value = decimal(gpz.price.amount * gpz.cal_pzprice() * asset2double(got), FLOAT);
 
     decimal profit = got_value - bid_value;
@@ -1112,6 +2352,7 @@ namespace pizzalend {
   };
 
   void pizzalend::_issue_pzsymbol(name to, name contract, asset quantity, std::string memo) {
+    TRACE_COUNT(actions, 1);
     action(
       permission_level{_self, name("active")},
       contract,
@@ -1121,6 +2362,7 @@ namespace pizzalend {
   };
 
   void pizzalend::_transfer_to(name to, name contract, asset quantity, std::string memo) {
+    TRACE_COUNT(actions, 1);
     action(
       permission_level{_self, name("active")},
       contract,
@@ -1130,6 +2372,7 @@ namespace pizzalend {
   };
 
   void pizzalend::_transfer_in(name from, name contract, asset quantity, std::string memo) {
+    TRACE_COUNT(actions, 1);
     action(
       permission_level{_self, name("active")},
       CAPITAL_ACCOUNT,
@@ -1139,6 +2382,7 @@ namespace pizzalend {
   };
 
   void pizzalend::_transfer_out(name to, name contract, asset quantity, std::string memo) {
+    TRACE_COUNT(actions, 1);
     action(
       permission_level{_self, name("active")},
       CAPITAL_ACCOUNT,
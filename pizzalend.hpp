@@ -1,6 +1,8 @@
 #include "common.hpp"
 #include "helper.hpp"
 #include "memo.hpp"
+#include "arena.hpp"
+#include "trace.hpp"
 
 #include "pizzafeed.hpp"
 #include "votepower.hpp"
@@ -56,6 +58,40 @@
 // 1 second
 #define INTEREST_CALCULATE_TTL 1
 
+// 1 hour
+#define ELIGIBILITY_TTL 3600
+
+// pushed prices are trusted for 2 mins, after that health sweeps poll feed.pizza again
+#define PRICE_PUSH_TTL 120
+
+// pushed timestamps may run this far ahead of the block time
+#define PRICE_PUSH_SKEW 5
+
+// 1%, price move that marks exposed accounts dirty
+#define EXPOSURE_PRICE_MOVE 0.01
+
+// exposed positions marked per call, the rest continues in the next uphealth
+#define EXPOSURE_MARK_LIMIT 200
+
+// 1%, allowed drop of the projected health factor once interest accrued since the refresh is charged
+#define SENSITIVITY_MARGIN 0.01
+
+// 1 day, health is refreshed at least this often even if prices have not moved
+#define SENSITIVITY_MAX_AGE 86400
+
+// never skip accounts projected below this factor
+#define SENSITIVITY_MIN_FACTOR 1.25
+
+// positions per account until setposlimit is called, bounds the cost of liquidating one account
+#define MAX_COLLATERAL_POSITIONS 10
+#define MAX_LOAN_POSITIONS 10
+
+// 10 mins, tick settles interest of a pztoken at most this often
+#define INTEREST_INTERVAL 600
+
+// votes needed to waive the variable borrow fee
+#define FEE_WAIVER_VOTES 100000
+
 // features
 #define FEATURE_DEPOSIT name("deposit")
 #define FEATURE_WITHDRAW name("withdraw")
@@ -126,13 +162,81 @@ namespace pizzalend {
     bool is_open;
   };
 
+  // pushed by the feed contract or operator
+  struct price_point {
+    extended_symbol anchor;
+    decimal price;
+    uint32_t timestamp;
+  };
+
+  // values held in one pztoken when health was cached
+  struct health_exposure {
+    name pzname;
+    decimal price;
+    double collateral_value;
+    double loan_value;
+  };
+
+  // cached accounts with health factor >= min_factor, up to the next bucket
+  struct health_bucket {
+    double min_factor;
+    uint64_t count;
+    double loan_value;
+  };
+
+  // pending operator work, see getwork
+  struct work_estimate {
+    // from the tick health cursor to the end of cachedhealth, as far as the next tick sweeps
+    uint32_t scanned_healths;
+    uint32_t due_healths;
+    // from the health histogram, covers the whole table
+    uint64_t below_one;
+    uint32_t dirty_healths;
+    uint32_t exposed_tokens;
+    // collateral/loan rows the exposed tokens still have to mark
+    uint32_t exposure_rows;
+    std::vector<name> stale_prices;
+    std::vector<name> stale_interest;
+    uint32_t interest_rows;
+    // budget a tick needs to clear all of the above
+    uint32_t estimated_rows;
+  };
+
+  // read-only quotes
+  struct health_quote {
+    name account;
+    double loan_value;
+    double collateral_value;
+    double loanable_collateral_value;
+    // -1 when the account has no loan
+    double factor;
+  };
+
+  struct borrow_quote {
+    name account;
+    name pzname;
+    asset max_borrow;
+    decimal variable_rate;
+    decimal stable_rate;
+    // fees when borrowing max_borrow
+    asset variable_fee;
+    asset stable_fee;
+  };
+
+  struct withdraw_quote {
+    name account;
+    name pzname;
+    asset max_withdraw;
+    asset max_redeem;
+  };
+
   class [[eosio::contract]] pizzalend : public contract {
   public:
     pizzalend(name self, name first_receiver, datastream<const char*> ds) : 
       contract(self, first_receiver, ds), pztokens(self, self.value), 
       collaterals(self, self.value), loans(self, self.value), liqdtorders(self, self.value),
-      baddebts(self, self.value), cached_healths(self, self.value), cachedstables(self, self.value),
-      earns(self, self.value) {}
+      baddebts(self, self.value), cached_healths(self, self.value),
+      earns(self, self.value), health_hists(self, self.value) {}
 
     [[eosio::action]]
     void addpztoken(name pzname, extended_symbol pzsymbol, extended_symbol anchor, pztoken_config config);
@@ -164,6 +268,18 @@ namespace pizzalend {
     [[eosio::action]]
     void borrow(name account, name contract, asset quantity, uint8_t type);
 
+    [[eosio::action]]
+    void borrowbal(name account, name contract, asset quantity, uint8_t type);
+
+    [[eosio::action]]
+    void repaybal(name account, name contract, asset quantity);
+
+    [[eosio::action]]
+    void collbal(name account, name contract, asset quantity);
+
+    [[eosio::action]]
+    void withdrawbal(name account, name contract, asset quantity);
+
     [[eosio::action]]
     void collswap(name frompz, name topz, decimal rate, uint32_t limit, uint64_t start);
 
@@ -177,14 +293,20 @@ namespace pizzalend {
 
     // every 1 min
     [[eosio::action]]
-    void uphealth();
+    void uphealth(uint32_t budget);
 
     [[eosio::action]]
-    void uphealth2(double threshold);
+    void uphealth2(double threshold, uint32_t budget);
 
     [[eosio::action]]
     void cachehealth();
 
+    [[eosio::action]]
+    void tick(uint32_t budget);
+
+    [[eosio::action]]
+    void synctotal(name pzname);
+
     [[eosio::action]]
     void addallow(name account, name feature, uint32_t duration);
 
@@ -206,16 +328,58 @@ namespace pizzalend {
     [[eosio::action]]
     void claimrex();
 
+    [[eosio::action]]
+    void refreshelig(std::vector<name> accounts);
+
+    [[eosio::action]]
+    void gc(uint32_t limit);
+
+    [[eosio::action]]
+    void sweep(uint32_t limit);
+
+    [[eosio::action]]
+    void setprices(std::vector<price_point> prices);
+
+    [[eosio::action]]
+    void setposlimit(uint16_t max_collaterals, uint16_t max_loans);
+
+    [[eosio::action]]
+    void migrate(name table, uint8_t target_version, uint32_t limit);
+
+    [[eosio::action]]
+    void setrefresh(double sigmas, uint32_t min_interval, uint32_t max_interval, double vol_alpha, double default_vol);
+
+    [[eosio::action, eosio::read_only]]
+    health_quote gethealth(name account);
+
+    [[eosio::action, eosio::read_only]]
+    borrow_quote getborrow(name account, name pzname);
+
+    [[eosio::action, eosio::read_only]]
+    withdraw_quote getwithdraw(name account, name pzname);
+
+    [[eosio::action, eosio::read_only]]
+    std::vector<health_bucket> gethist();
+
+    // limit: max cachedhealth, loan and exposed rows to scan
+    [[eosio::action, eosio::read_only]]
+    work_estimate getwork(uint32_t limit);
+
     #ifndef MAINNET
     [[eosio::action]]
     void clear();
 
     [[eosio::action]]
     void rmpztoken(name pzname);
+
+    // one packed row per entry, e.g. get_table_rows with json=false, see tools/bulkexport.py
+    [[eosio::action]]
+    void bulkload(name table, std::vector<std::vector<char>> rows);
     #endif
 
   private:
-    void _log(name event, std::vector<std::string> args) {
+    void _log(name event, const arena_vector<std::string>& args) {
+      TRACE_COUNT(actions, 1);
       uint64_t millis = current_millis();
       action(
         permission_level{_self, name("active")},
@@ -226,63 +390,67 @@ namespace pizzalend {
     };
 
     void _log_deposit(name account, name pzname, asset quantity, asset pzquantity) {
-      std::vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string(), pzquantity.to_string()};
+      arena_vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string(), pzquantity.to_string()};
       _log(name("deposit"), args);
     };
 
     void _log_collateral(name account, name pzname, asset quantity, asset pzquantity) {
-      std::vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string(), pzquantity.to_string()};
+      arena_vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string(), pzquantity.to_string()};
       _log(name("collateral"), args);
     };
 
     void _log_upcollateral(name account, name pzname, asset pzquantity, asset quantity) {
-      std::vector<std::string> args = {account.to_string(), pzname.to_string(), pzquantity.to_string(), quantity.to_string()};
+      arena_vector<std::string> args = {account.to_string(), pzname.to_string(), pzquantity.to_string(), quantity.to_string()};
       _log(name("upcollateral"), args);
     };
 
     void _log_redeem(name account, name pzname, asset pzquantity) {
-      std::vector<std::string> args = {account.to_string(), pzname.to_string(), pzquantity.to_string()};
+      arena_vector<std::string> args = {account.to_string(), pzname.to_string(), pzquantity.to_string()};
       _log(name("redeem"), args);
     };
 
     void _log_withdraw(name account, name pzname, asset quantity, asset pzquantity) {
-      std::vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string(), pzquantity.to_string()};
+      arena_vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string(), pzquantity.to_string()};
       _log(name("withdraw"), args);
     };
 
     void _log_borrow(name account, name pzname, asset quantity, asset fee, uint8_t type) {
-      std::vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string(), fee.to_string(), std::to_string(type)};
+      arena_vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string(), fee.to_string(), std::to_string(type)};
       _log(name("borrow"), args);
     };
 
     void _log_upborrow(name account, name pzname, asset quantity) {
-      std::vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string()};
+      arena_vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string()};
       _log(name("upborrow"), args);
     };
 
     void _log_upborrows(name pzname) {
-      std::vector<std::string> args;
-      args.push_back(pzname.to_string());
+      arena_vector<std::string> args = {pzname.to_string()};
       _log(name("upborrows"), args);
     };
 
     void _log_repay(name account, name pzname, asset quantity) {
-      std::vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string()};
+      arena_vector<std::string> args = {account.to_string(), pzname.to_string(), quantity.to_string()};
       _log(name("repay"), args);
     };
 
+    void _log_balance(name account, name contract, asset balance) {
+      arena_vector<std::string> args = {account.to_string(), contract.to_string(), balance.to_string()};
+      _log(name("balance"), args);
+    };
+
     void _log_liqdt(name account, name collateral_contract, asset collateral, name loan_contract, asset loan) {
-      std::vector<std::string> args = {account.to_string(), collateral_contract.to_string(), collateral.to_string(), loan_contract.to_string(), loan.to_string()};
+      arena_vector<std::string> args = {account.to_string(), collateral_contract.to_string(), collateral.to_string(), loan_contract.to_string(), loan.to_string()};
       _log(name("liqdt"), args);
     };
 
     void _log_bid(name account, name bid_contract, asset bid, name got_contract, asset got, decimal profit_rate) {
-      std::vector<std::string> args = {account.to_string(), bid_contract.to_string(), bid.to_string(), got_contract.to_string(), got.to_string(), profit_rate.to_string()};
+      arena_vector<std::string> args = {account.to_string(), bid_contract.to_string(), bid.to_string(), got_contract.to_string(), got.to_string(), profit_rate.to_string()};
       _log(name("bid"), args);
     };
 
     void _log_insolvent(name account, name pzname, name contract, asset quantity) {
-      std::vector<std::string> args = {account.to_string(), pzname.to_string(), contract.to_string(), quantity.to_string()};
+      arena_vector<std::string> args = {account.to_string(), pzname.to_string(), contract.to_string(), quantity.to_string()};
       _log(name("insolvent"), args);
     };
 
@@ -296,13 +464,56 @@ namespace pizzalend {
 
     double _cal_health_factor(name account);
 
-    struct simple_pztoken {
-      name pzname;
-      double price;
-      double pzprice;
-      double liqdt_rate;
+    // collateral value by liqdt_rate and by max_ltv in one scan
+    void _cal_collateral_values(name account, double& collateral_value, double& loanable_value);
+
+    struct acc_value {
+      double loan_value;
+      double collateral_value;
+      double loanable_collateral_value;
+
+      acc_value() : loan_value(0), collateral_value(0), loanable_collateral_value(0) {}
+
+      acc_value(double l, double c, double lc) {
+        loan_value = l;
+        collateral_value = c;
+        loanable_collateral_value = lc;
+      }
+    };
+
+    // reuses cached health when it was computed under the current valuation epoch
+    acc_value _cal_acc_value(name account);
+
+    struct health_detail {
+      double loan_value;
+      double collateral_value;
+      double loanable_value;
+      arena_vector<health_exposure> exposures;
+      uint16_t collateral_count;
+      uint16_t loan_count;
+      double max_rate;
+
+      health_detail() : loan_value(0), collateral_value(0), loanable_value(0), collateral_count(0), loan_count(0), max_rate(0) {}
+
+      double factor() const {
+        return loan_value > 0 ? collateral_value/loan_value : 0;
+      }
+
+      void add(name pzname, decimal price, double collateral_value, double loan_value) {
+        for (auto itr = exposures.begin(); itr != exposures.end(); itr++) {
+          if (itr->pzname == pzname) {
+            itr->collateral_value += collateral_value;
+            itr->loan_value += loan_value;
+            return;
+          }
+        }
+        exposures.push_back(health_exposure{pzname, price, collateral_value, loan_value});
+      }
     };
 
+    // loans and collaterals of the account in one pass each
+    health_detail _cal_health_detail(name account);
+
     struct [[eosio::table]] pztoken {
       name pzname;
       extended_symbol pzsymbol;
@@ -322,6 +533,8 @@ namespace pizzalend {
       double pzprice_rate;
       uint64_t updated_at;
       pztoken_config config;
+      // sum of fixed_rate.amount * quantity.amount over stable loans, exact
+      binary_extension<uint128_t> stable_weight;
 
       uint128_t by_pzsymbol() const {
         return raw(pzsymbol);
@@ -391,14 +604,14 @@ namespace pizzalend {
         return pzprice * (1 + pzprice_rate * secs);
       };
 
-      asset cal_pzquantity(asset quantity) {
+      asset cal_pzquantity(asset quantity) const {
         check(quantity.symbol == anchor.get_symbol(), "attempt to calculate pzquantity with different anchor symbol");
         asset pzquantity = asset(0, pzsymbol.get_symbol());
         pzquantity.amount = asset2double(quantity) * pow(10, pzquantity.symbol.precision()) / cal_pzprice();
         return pzquantity;
       }
 
-      asset cal_anchor_quantity(asset pzquantity) {
+      asset cal_anchor_quantity(asset pzquantity) const {
         check(pzquantity.symbol == pzsymbol.get_symbol(), "attempt to calculate anchor quantity with different pz symbol");
         asset quantity = asset(0, anchor.get_symbol());
         quantity.amount = asset2double(pzquantity) * pow(10, quantity.symbol.precision()) * cal_pzprice();
@@ -409,18 +622,9 @@ namespace pizzalend {
         asset borrowed = trans_asset(available_deposit.symbol, borrow);
         int64_t undrawn_amount = (double)pzquantity.amount * cal_pzprice();
         asset undrawn = asset(undrawn_amount, available_deposit.symbol);
-        print_f("borrowed: %, available deposit: %, undrawn: %, ", borrowed, available_deposit, undrawn);
+        TRACE_DEBUG("borrowed: %, available deposit: %, undrawn: %, ", borrowed, available_deposit, undrawn);
         return borrowed + available_deposit - undrawn;
       };
-
-      simple_pztoken simple() const {
-        simple_pztoken sp;
-        sp.pzname = pzname;
-        sp.price = decimal2double(price);
-        sp.pzprice = cal_pzprice();
-        sp.liqdt_rate = decimal2double(config.liqdt_rate);
-        return sp;
-      }
     };
 
     typedef eosio::multi_index<
@@ -436,19 +640,25 @@ namespace pizzalend {
 
     void _recal_pztoken(pztoken_tlb::const_iterator pztoken_itr);
 
-    pztoken _get_pztoken_byanchor(extended_symbol anchor) {
+    const pztoken& _get_pztoken_byanchor(extended_symbol anchor) {
       auto pztokens_byanchor = pztokens.get_index<name("byanchor")>();
-      std::string msg = "pztoken with anchor " + anchor.get_symbol().code().to_string() + " not found";
-      return pztokens_byanchor.get(raw(anchor), msg.c_str());
+      auto itr = pztokens_byanchor.find(raw(anchor));
+      if (itr == pztokens_byanchor.end()) {
+        check(false, "pztoken with anchor " + anchor.get_symbol().code().to_string() + " not found");
+      }
+      return *itr;
     };
 
-    pztoken _get_pztoken_bypzsymbol(extended_symbol pzsymbol) {
+    const pztoken& _get_pztoken_bypzsymbol(extended_symbol pzsymbol) {
       auto pztokens_bypzsymbol = pztokens.get_index<name("bypzsymbol")>();
-      std::string msg = "pztoken with pzsymbol " + pzsymbol.get_symbol().code().to_string() + " not found";
-      return pztokens_bypzsymbol.get(raw(pzsymbol), msg.c_str());
+      auto itr = pztokens_bypzsymbol.find(raw(pzsymbol));
+      if (itr == pztokens_bypzsymbol.end()) {
+        check(false, "pztoken with pzsymbol " + pzsymbol.get_symbol().code().to_string() + " not found");
+      }
+      return *itr;
     };
 
-    pztoken _get_pztoken_bysymbol(extended_symbol sym) {
+    const pztoken& _get_pztoken_bysymbol(extended_symbol sym) {
       if (sym.get_contract() == PZTOKEN_CONTRACT) {
         return _get_pztoken_bypzsymbol(sym);
       }
@@ -531,23 +741,209 @@ namespace pizzalend {
       });
     };
 
-    void _uphealth(double threshold = 0);
+    // budget: rows to visit, charged like tick
+    void _uphealth(double threshold, uint32_t budget);
+
+    // budget: rows to visit, decremented as they are visited
+    bool _refresh_dirty_healths(uint32_t& budget);
+
+    // resumes from cursor, which is 0 again once the table has been walked to the end
+    bool _sweep_healths(double threshold, uint64_t& cursor, uint32_t& budget);
+
+    // budget units tick charges, getwork estimates with the same function
+    // health rows are charged one each inside _refresh_dirty_healths and _sweep_healths
+    uint32_t _tick_cost(uint32_t tokens, uint32_t loans, uint32_t exposure_rows, uint32_t healths) {
+      return tokens + loans + exposure_rows + healths;
+    };
+
+    void _refresh_health(name account);
+
+    // return:
+    //   loans visited
+    uint32_t _settle_pending_interest(pztoken_tlb::const_iterator pztoken_itr);
+
+    uint32_t _calculate_interest(pztoken_tlb::const_iterator pztoken_itr);
+
+    // last interest settlement of each pztoken
+    struct [[eosio::table]] interest_info {
+      name pzname;
+      uint32_t settled_at;
+
+      uint64_t primary_key() const { return pzname.value; }
+    };
+    typedef eosio::multi_index<name("interestinfo"), interest_info> interestinfo_tlb;
+
+    struct [[eosio::table]] tick_state {
+      uint64_t health_cursor;
+      uint64_t updated_at;
+
+      uint64_t primary_key() const { return 0; }
+    };
+    typedef eosio::multi_index<name("tickstate"), tick_state> tickstate_tlb;
 
-    void _settle_pending_interest(pztoken_tlb::const_iterator pztoken_itr);
+    // shared by tick and uphealth, a sweep resumes where the last one stopped
+    uint64_t _get_health_cursor() {
+      tickstate_tlb tickstates(_self, _self.value);
+      auto itr = tickstates.find(0);
+      return itr != tickstates.end() ? itr->health_cursor : 0;
+    };
 
-    void _calculate_interest(pztoken_tlb::const_iterator pztoken_itr);
+    void _set_health_cursor(uint64_t cursor) {
+      tickstate_tlb tickstates(_self, _self.value);
+      auto itr = tickstates.find(0);
+      if (itr == tickstates.end()) {
+        tickstates.emplace(_self, [&](auto& row) {
+          row.health_cursor = cursor;
+          row.updated_at = current_millis();
+        });
+      } else {
+        tickstates.modify(itr, _self, [&](auto& row) {
+          row.health_cursor = cursor;
+          row.updated_at = current_millis();
+        });
+      }
+    };
 
     bool _update_anchor_price(pztoken_tlb::const_iterator pztoken_itr);
 
+    bool _set_anchor_price(pztoken_tlb::const_iterator pztoken_itr, decimal price);
+
+    // epoch is bumped whenever any pztoken price changes,
+    // config_version whenever a pztoken config that feeds valuations changes
+    struct [[eosio::table]] price_state {
+      uint64_t epoch;
+      uint64_t swept_epoch;
+      uint32_t pushed_at;
+      uint64_t config_version;
+
+      uint64_t primary_key() const { return 0; }
+    };
+    typedef eosio::multi_index<name("pricestate"), price_state> pricestate_tlb;
+
+    price_state _get_price_state() {
+      pricestate_tlb pricestates(_self, _self.value);
+      auto itr = pricestates.find(0);
+      if (itr == pricestates.end()) {
+        return price_state{0, 0, 0, 1};
+      }
+      return *itr;
+    };
+
+    void _set_price_state(const price_state& state) {
+      pricestate_tlb pricestates(_self, _self.value);
+      auto itr = pricestates.find(0);
+      if (itr == pricestates.end()) {
+        pricestates.emplace(_self, [&](auto& row) {
+          row = state;
+        });
+      } else {
+        pricestates.modify(itr, _self, [&](auto& row) {
+          row = state;
+        });
+      }
+    };
+
+    // latest pushed price time of each pztoken
+    struct [[eosio::table]] price_info {
+      name pzname;
+      uint32_t price_at;
+
+      uint64_t primary_key() const { return pzname.value; }
+    };
+    typedef eosio::multi_index<name("priceinfo"), price_info> priceinfo_tlb;
+
+    // layout version of a table, migrations backfill rows in place and readers
+    // that depend on the backfill check the version, e.g. loans v2 for stabledue
+    struct [[eosio::table]] migration_state {
+      name table;
+      uint8_t version;
+      // equal to version when no migration is running
+      uint8_t target_version;
+      uint64_t cursor;
+      uint64_t scanned;
+      uint64_t migrated;
+      uint64_t started_at;
+      uint64_t completed_at;
+
+      uint64_t primary_key() const { return table.value; }
+    };
+    typedef eosio::multi_index<name("migration"), migration_state> migration_tlb;
+
+    uint8_t _get_table_version(name table) {
+      migration_tlb migrations(_self, _self.value);
+      auto itr = migrations.find(table.value);
+      return itr == migrations.end() ? 1 : itr->version;
+    };
+
+    // returns true if prices moved since the last health sweep
+    bool _refresh_prices();
+
+    // hourly volatility of each pztoken, an ewma of relative moves scaled by sqrt(hours)
+    struct [[eosio::table]] price_vol {
+      name pzname;
+      double volatility;
+      uint32_t moved_at;
+
+      uint64_t primary_key() const { return pzname.value; }
+    };
+    typedef eosio::multi_index<name("pricevol"), price_vol> pricevol_tlb;
+
+    void _record_price_move(name pzname, decimal old_price, decimal new_price);
+
+    // refresh interval of cached health: time for sigmas * volatility to eat the margin above 1.0
+    struct [[eosio::table]] refresh_policy {
+      double sigmas;
+      uint32_t min_interval;
+      uint32_t max_interval;
+      double vol_alpha;
+      // used for tokens without recorded moves
+      double default_vol;
+
+      uint64_t primary_key() const { return 0; }
+    };
+    typedef eosio::multi_index<name("refreshpol"), refresh_policy> refreshpol_tlb;
+
+    refresh_policy _get_refresh_policy() {
+      refreshpol_tlb refreshpols(_self, _self.value);
+      auto itr = refreshpols.find(0);
+      if (itr == refreshpols.end()) {
+        return refresh_policy{4, 360, 15000, 0.1, 0.05};
+      }
+      return *itr;
+    };
+
+    // prices are unchanged but valuations are not, e.g. interest settled into loans
+    void _bump_price_epoch() {
+      price_state state = _get_price_state();
+      state.epoch++;
+      _set_price_state(state);
+    };
+
+    // liqdt_rate or max_ltv changed, cached valuations and projections are stale
+    void _bump_config_version() {
+      price_state state = _get_price_state();
+      state.config_version++;
+      _set_price_state(state);
+    };
+
+    void _mark_prices_swept() {
+      price_state state = _get_price_state();
+      if (state.swept_epoch != state.epoch) {
+        state.swept_epoch = state.epoch;
+        _set_price_state(state);
+      }
+    };
+
     decimal _get_anchor_price(name pzname);
 
-    double _cal_withdrawable_value(name account, pztoken pz) {
-      double loan_value = _cal_loan_value(account);
+    double _cal_withdrawable_value(name account, const pztoken& pz) {
+      acc_value value = _cal_acc_value(account);
+      double loan_value = value.loan_value;
       if (loan_value <= 0) {
         return -1;
       }
 
-      double collateral_value = _cal_collateral_value(account);
+      double collateral_value = value.collateral_value;
       if (collateral_value <= 0) {
         return 0;
       };
@@ -585,13 +981,16 @@ namespace pizzalend {
       }
     };
 
-    decimal cal_fixed_rate(pztoken pz, int64_t incr_borrow_amount = 0) {
+    // dry_run: quote only, leave pzrate records untouched
+    decimal cal_fixed_rate(const pztoken& pz, int64_t incr_borrow_amount = 0, bool dry_run = false) {
       decimal latest_rate = pz.cal_floating_rate(incr_borrow_amount);
-      _record_pzrate(pz.pzname, latest_rate);
+      if (!dry_run) {
+        _record_pzrate(pz.pzname, latest_rate);
+      }
 
       uint64_t now = current_hour();
       pzrate_tlb pzrates(_self, pz.pzname.value);
-      std::vector<decimal> rates;
+      arena_vector<decimal> rates;
       
       auto itr = pzrates.begin();
       if (itr == pzrates.end()) {
@@ -608,7 +1007,11 @@ namespace pizzalend {
         while(itr != pzrates.end() && itr->time <= begin_time) {
           begin_rate = itr->rate;
           if (itr->time < begin_time) {
-            itr = pzrates.erase(itr);
+            if (dry_run) {
+              itr++;
+            } else {
+              itr = pzrates.erase(itr);
+            }
           } else {
             break;
           }
@@ -622,20 +1025,23 @@ namespace pizzalend {
         auto itr = pzrates.find(latest_time);
         if (itr != pzrates.end()) {
           current_rate = itr->rate;
-        } else {
+        } else if (!dry_run) {
           _record_pzrate(pz.pzname, current_rate, latest_time);
         }
+        if (dry_run && latest_time == now && current_rate < latest_rate) {
+          current_rate = latest_rate;
+        }
         rates.push_back(current_rate);
         latest_time += 3600;
       }
 
-      std::sort(rates.begin(), rates.end());
+      insertion_sort(rates.begin(), rates.end());
       decimal fixed_rate = rates[rates.size()/2];
-      print_f("latest floating rate: %, fixed rate: %, ", latest_rate, fixed_rate);
+      TRACE_DEBUG("latest floating rate: %, fixed rate: %, ", latest_rate, fixed_rate);
       if (fixed_rate.amount > latest_rate.amount * 1.5) {
         fixed_rate.amount = latest_rate.amount * 1.5;
       }
-      print_f("fixed rate: % | ", fixed_rate);
+      TRACE_DEBUG("fixed rate: % | ", fixed_rate);
       return fixed_rate;
     };
 
@@ -669,8 +1075,11 @@ namespace pizzalend {
     > collateral_tlb;
     collateral_tlb collaterals;
 
-    void _incr_collateral(name account, pztoken pz, asset pzquantity) {
+    void _incr_collateral(name account, const pztoken& pz, asset pzquantity) {
       check(pzquantity.amount > 0, "collateral quantity must be positive");
+      TRACE_COUNT(reads, 1);
+      TRACE_COUNT(writes, 1);
+      _invalidate_health(account);
 
       auto collaterals_byaccpzname = collaterals.get_index<name("byaccpzname")>();
       auto itr = collaterals_byaccpzname.find(raw(account, pz.pzname));
@@ -679,8 +1088,12 @@ namespace pizzalend {
           row.quantity += pzquantity;
           row.updated_at = current_millis();
         });
+        _update_collateral_total(pz, pzquantity, 0);
         _log_upcollateral(account, pz.pzname, itr->quantity, pz.cal_anchor_quantity(itr->quantity));
       } else {
+        _check_position_limit(account, true);
+        _update_collateral_total(pz, pzquantity, 1);
+        _count_position(account, true, 1);
         collaterals.emplace(_self, [&](auto& row) {
           row.id = collaterals.available_primary_key();
           row.account = account;
@@ -694,8 +1107,11 @@ namespace pizzalend {
 
     // return:
     //   actual reduction
-    asset _decr_collateral(name account, pztoken pz, asset pzquantity) {
+    asset _decr_collateral(name account, const pztoken& pz, asset pzquantity) {
       check(pzquantity.amount > 0, "collateral quantity must be positive");
+      TRACE_COUNT(reads, 1);
+      TRACE_COUNT(writes, 1);
+      _invalidate_health(account);
 
       auto collaterals_byaccpzname = collaterals.get_index<name("byaccpzname")>();
       auto itr = collaterals_byaccpzname.find(raw(account, pz.pzname));
@@ -710,9 +1126,12 @@ namespace pizzalend {
       }
 
       if (itr->quantity == exact_quantity) {
+        _update_collateral_total(pz, -exact_quantity, -1);
         collaterals_byaccpzname.erase(itr);
+        _count_position(account, true, -1);
         _log_upcollateral(account, pz.pzname, asset(0, exact_quantity.symbol), asset(0, pz.anchor.get_symbol()));
       } else {
+        _update_collateral_total(pz, -exact_quantity, 0);
         collaterals_byaccpzname.modify(itr, _self, [&](auto& row) {
           row.quantity -= exact_quantity;
           row.updated_at = current_millis();
@@ -722,7 +1141,68 @@ namespace pizzalend {
       return exact_quantity;
     };
 
-    std::vector<collateral> _get_acccollaterals_byliqdt(name account);
+    // collateral pledged in each pztoken, valued at the last price
+    struct [[eosio::table]] collateral_total {
+      name pzname;
+      asset pzquantity;
+      double value;
+      uint64_t accounts;
+      uint64_t updated_at;
+
+      uint64_t primary_key() const { return pzname.value; }
+    };
+    typedef eosio::multi_index<name("colltotal"), collateral_total> colltotal_tlb;
+
+    // delta 0 only revalues the total at the current price
+    void _update_collateral_total(const pztoken& pz, asset delta, int64_t account_delta) {
+      colltotal_tlb colltotals(_self, _self.value);
+      auto itr = colltotals.find(pz.pzname.value);
+      if (itr == colltotals.end()) {
+        if (delta.amount <= 0) return;
+        colltotals.emplace(_self, [&](auto& row) {
+          row.pzname = pz.pzname;
+          row.pzquantity = delta;
+          row.value = decimal2double(pz.price) * pz.cal_pzprice() * asset2double(delta);
+          row.accounts = account_delta > 0 ? account_delta : 0;
+          row.updated_at = current_millis();
+        });
+        return;
+      }
+
+      colltotals.modify(itr, _self, [&](auto& row) {
+        // totals tracked before synctotal may lag behind, never go negative
+        row.pzquantity.amount = std::max(row.pzquantity.amount + delta.amount, (int64_t)0);
+        row.value = decimal2double(pz.price) * pz.cal_pzprice() * asset2double(row.pzquantity);
+        if (account_delta < 0 && row.accounts < (uint64_t)-account_delta) {
+          row.accounts = 0;
+        } else {
+          row.accounts += account_delta;
+        }
+        row.updated_at = current_millis();
+      });
+    };
+
+    struct [[eosio::table]] position_limit {
+      uint16_t max_collaterals;
+      uint16_t max_loans;
+
+      uint64_t primary_key() const { return 0; }
+    };
+    typedef eosio::multi_index<name("poslimit"), position_limit> poslimit_tlb;
+
+    position_limit _get_position_limit() {
+      poslimit_tlb poslimits(_self, _self.value);
+      auto itr = poslimits.find(0);
+      if (itr == poslimits.end()) {
+        return position_limit{MAX_COLLATERAL_POSITIONS, MAX_LOAN_POSITIONS};
+      }
+      return *itr;
+    };
+
+    // called before opening a new position
+    void _check_position_limit(name account, bool is_collateral);
+
+    arena_vector<collateral> _get_acccollaterals_byliqdt(name account);
 
     enum BorrowType {
       Variable = 1,
@@ -767,6 +1247,11 @@ namespace pizzalend {
         return interest;
       }
 
+      uint128_t stable_weight() const {
+        if (type != BorrowType::Stable) return 0;
+        return (uint128_t)fixed_rate.amount * quantity.amount;
+      }
+
       asset actual_quantity() const {
         return trans_asset(principal.symbol, quantity);
       };
@@ -780,10 +1265,124 @@ namespace pizzalend {
     > loan_tlb;
     loan_tlb loans;
 
-    std::vector<loan> _get_accloans_byliqdt(name account);
+    arena_vector<loan> _get_accloans_byliqdt(name account);
+
+    // countdown time of a pztoken, runs TURN_VARIABLE_ACCELERATE times faster at high usage
+    // without a row the clock runs at real time
+    struct [[eosio::table]] stable_clock {
+      name pzname;
+      // countdown millis elapsed at changed_at
+      uint64_t elapsed;
+      uint64_t changed_at;
+      uint64_t speed;
+
+      uint64_t primary_key() const { return pzname.value; }
+    };
+    typedef eosio::multi_index<name("stableclock"), stable_clock> stableclock_tlb;
+
+    // countdown millis elapsed per real milli
+    uint64_t _turn_variable_speed(decimal usage_rate) {
+      return usage_rate >= TURN_VARIABLE_ACCELERATE_USAGE_RATE ? TURN_VARIABLE_ACCELERATE : 1;
+    };
+
+    uint64_t _read_stable_clock(name pzname, uint64_t now) {
+      stableclock_tlb clocks(_self, _self.value);
+      auto itr = clocks.find(pzname.value);
+      if (itr == clocks.end()) return now;
+      return itr->elapsed + (now - std::min(now, itr->changed_at)) * itr->speed;
+    };
+
+    // one row per speed change, due loans keep their place in the index
+    void _set_stable_speed(name pzname, uint64_t speed, uint64_t now) {
+      stableclock_tlb clocks(_self, _self.value);
+      auto itr = clocks.find(pzname.value);
+      if ((itr == clocks.end() ? 1 : itr->speed) == speed) return;
+
+      uint64_t elapsed = _read_stable_clock(pzname, now);
+      if (itr == clocks.end()) {
+        clocks.emplace(_self, [&](auto& row) {
+          row.pzname = pzname;
+          row.elapsed = elapsed;
+          row.changed_at = now;
+          row.speed = speed;
+        });
+      } else {
+        clocks.modify(itr, _self, [&](auto& row) {
+          row.elapsed = elapsed;
+          row.changed_at = now;
+          row.speed = speed;
+        });
+      }
+    };
 
-    void _incr_loan(name account, pztoken pz, asset quantity, uint8_t type) {
+    // stable clock reading at which a stable loan turns variable
+    struct [[eosio::table]] stable_due {
+      uint64_t loan_id;
+      name pzname;
+      uint64_t due;
+
+      uint64_t primary_key() const { return loan_id; }
+
+      uint128_t by_pz_due() const {
+        return (uint128_t)pzname.value << 64 | due;
+      }
+    };
+
+    typedef eosio::multi_index<
+      name("stabledue"), stable_due,
+      indexed_by<name("bypzdue"), const_mem_fun<stable_due, uint128_t, &stable_due::by_pz_due>>
+    > stabledue_tlb;
+
+    void _set_stable_due(uint64_t loan_id, const pztoken& pz, uint64_t countdown, uint64_t now) {
+      uint64_t due = _read_stable_clock(pz.pzname, now) + countdown;
+      stabledue_tlb dues(_self, _self.value);
+      auto itr = dues.find(loan_id);
+      if (itr == dues.end()) {
+        dues.emplace(_self, [&](auto& row) {
+          row.loan_id = loan_id;
+          row.pzname = pz.pzname;
+          row.due = due;
+        });
+      } else {
+        dues.modify(itr, _self, [&](auto& row) {
+          row.due = due;
+        });
+      }
+    };
+
+    void _remove_stable_due(uint64_t loan_id) {
+      stabledue_tlb dues(_self, _self.value);
+      auto itr = dues.find(loan_id);
+      if (itr != dues.end()) {
+        dues.erase(itr);
+      }
+    };
+
+    // countdown stored on the loan, less what passed since it was last decremented
+    uint64_t _remaining_countdown(const loan& row, const pztoken& pz, uint64_t now) {
+      uint64_t passed = (now - std::min(now, row.last_calculated_at)) * _turn_variable_speed(pz.usage_rate);
+      return row.turn_variable_countdown > passed ? row.turn_variable_countdown - passed : 0;
+    };
+
+    // countdown left in loan terms, or -1 if the loan has no due entry yet
+    int64_t _get_stable_countdown(uint64_t loan_id, const pztoken& pz, uint64_t now) {
+      stabledue_tlb dues(_self, _self.value);
+      auto itr = dues.find(loan_id);
+      if (itr == dues.end()) return -1;
+      uint64_t clock = _read_stable_clock(pz.pzname, now);
+      return itr->due > clock ? itr->due - clock : 0;
+    };
+
+    // turns the due stable loans of a pztoken variable, the totals are adjusted in place
+    void _convert_due_loans(name pzname, uint64_t now, asset& stable_borrow, asset& variable_borrow, uint128_t& stable_weight);
+
+    uint32_t _migrate_loans(uint64_t& cursor, bool& done, uint32_t limit, uint32_t& scanned);
+
+    void _incr_loan(name account, const pztoken& pz, asset quantity, uint8_t type) {
       check(quantity.amount > 0, "loan quantity must be positive");
+      TRACE_COUNT(reads, 1);
+      TRACE_COUNT(writes, 1);
+      _invalidate_health(account);
 
       auto loans_byaccpzname = loans.get_index<name("byaccpzname")>();
       auto itr = loans_byaccpzname.find(raw(account, pz.pzname));
@@ -791,13 +1390,11 @@ namespace pizzalend {
       uint64_t now = current_millis();
       asset exact_quantity = trans_asset(pz.borrow_sym(), quantity);
 
-      double old_stable_interest = 0;
-      double new_stable_interest = 0;
+      uint128_t old_stable_weight = 0;
+      uint128_t new_stable_weight = 0;
 
       if (itr != loans_byaccpzname.end()) {
-        if (itr->type == BorrowType::Stable) {
-          old_stable_interest = decimal2double(itr->fixed_rate) * asset2double(itr->quantity);
-        }
+        old_stable_weight = itr->stable_weight();
 
         if (itr->type != type) {
           _switch_pztoken_borrow_type(pz.pzname, itr->quantity, type);
@@ -821,12 +1418,17 @@ namespace pizzalend {
           row.updated_at = now;
         });
 
+        new_stable_weight = itr->stable_weight();
         if (type == BorrowType::Stable) {
-          new_stable_interest = decimal2double(itr->fixed_rate) * asset2double(itr->quantity);
+          _set_stable_due(itr->id, pz, TURN_VARIABLE_COUNTDOWN, now);
+        } else {
+          _remove_stable_due(itr->id);
         }
 
         _log_upborrow(account, pz.pzname, itr->quantity);
       } else {
+        _check_position_limit(account, false);
+        _count_position(account, false, 1);
         auto loan_itr = loans.emplace(_self, [&](auto& row) {
           row.id = loans.available_primary_key();
           row.account = account;
@@ -845,31 +1447,33 @@ namespace pizzalend {
           row.updated_at = now;
         });
 
+        new_stable_weight = loan_itr->stable_weight();
         if (type == BorrowType::Stable) {
-          new_stable_interest = decimal2double(loan_itr->fixed_rate) * asset2double(loan_itr->quantity);
+          _set_stable_due(loan_itr->id, pz, TURN_VARIABLE_COUNTDOWN, now);
         }
         _log_upborrow(account, pz.pzname, exact_quantity);
       }
 
-      if (new_stable_interest != old_stable_interest) {
-        _change_stable_interest(pz.pzname, new_stable_interest - old_stable_interest);
+      if (new_stable_weight != old_stable_weight) {
+        _change_stable_weight(pz.pzname, old_stable_weight, new_stable_weight);
       }
 
       _update_pztoken_borrow(pz.pzname, quantity, exact_quantity, type);
     };
 
-    void _decr_loan(name account, pztoken pz, asset quantity, bool is_liqdt = false) {
+    void _decr_loan(name account, const pztoken& pz, asset quantity, bool is_liqdt = false) {
       check(quantity.amount > 0, "loan quantity must be positive");
+      TRACE_COUNT(reads, 1);
+      TRACE_COUNT(writes, 1);
+      _invalidate_health(account);
 
       auto loans_byaccpzname = loans.get_index<name("byaccpzname")>();
       auto itr = loans_byaccpzname.find(raw(account, pz.pzname));
       check(itr != loans_byaccpzname.end(), "loan not found");
 
-      double old_stable_interest = 0;
-      double new_stable_interest = 0;
-      if (itr->type == BorrowType::Stable) {
-        old_stable_interest = decimal2double(itr->fixed_rate) * asset2double(itr->quantity);
-      }
+      uint128_t old_stable_weight = 0;
+      uint128_t new_stable_weight = 0;
+      old_stable_weight = itr->stable_weight();
 
       decimal rate = itr->type == BorrowType::Stable ? itr->fixed_rate : pz.floating_rate;
       asset interest = itr->cal_pending_interest(rate);
@@ -891,11 +1495,16 @@ namespace pizzalend {
       uint64_t now = current_millis();
       if (actual_remain.amount > 0) {
         uint64_t pass_millis = now - itr->last_calculated_at;
+        // until loans v2 completes, settle keeps the countdown on the row and due entries are not read
+        bool indexed = _get_table_version(name("loans")) >= 2;
+        int64_t countdown = indexed && type == BorrowType::Stable ? _get_stable_countdown(itr->id, pz, now) : -1;
         loans_byaccpzname.modify(itr, _self, [&](auto& row) {
           row.quantity = remain;
           row.principal = principal_remain;
           row.last_calculated_at = now;
-          if (row.type == BorrowType::Stable) {
+          if (countdown >= 0) {
+            row.turn_variable_countdown = countdown;
+          } else if (row.type == BorrowType::Stable) {
             if (pass_millis < row.turn_variable_countdown) {
               row.turn_variable_countdown -= pass_millis;
             } else {
@@ -904,24 +1513,24 @@ namespace pizzalend {
           }
           row.updated_at = now;
         });
-        if (itr->type == BorrowType::Stable) {
-          new_stable_interest = decimal2double(itr->fixed_rate) * asset2double(itr->quantity);
-        }
+        new_stable_weight = itr->stable_weight();
         _log_upborrow(account, pz.pzname, itr->quantity);
       } else {
         exact_quantity = itr->quantity;
+        _remove_stable_due(itr->id);
         loans_byaccpzname.erase(itr);
+        _count_position(account, false, -1);
         _log_upborrow(account, pz.pzname, asset(0, exact_quantity.symbol));
       }
 
-      if (new_stable_interest != old_stable_interest) {
-        _change_stable_interest(pz.pzname, new_stable_interest - old_stable_interest);
+      if (new_stable_weight != old_stable_weight) {
+        _change_stable_weight(pz.pzname, old_stable_weight, new_stable_weight);
       }
 
-      _update_pztoken_borrow(itr->pzname, -raw_quantity, -(exact_quantity-interest), type, is_liqdt);
+      _update_pztoken_borrow(pz.pzname, -raw_quantity, -(exact_quantity-interest), type, is_liqdt);
     };
 
-    asset _cal_loan_fee(name account, pztoken pz, asset quantity, uint8_t type);
+    asset _cal_loan_fee(name account, const pztoken& pz, asset quantity, uint8_t type, bool dry_run = false);
 
     struct [[eosio::table]] feature {
       name pzname;
@@ -934,7 +1543,7 @@ namespace pizzalend {
 
     void _setfeatures(name pzname, std::vector<feature_perm> perms);
 
-    void _check_feature(pztoken pz, name account, name fname);
+    void _check_feature(const pztoken& pz, name account, name fname);
 
     struct [[eosio::table]] liqdtorder {
       uint64_t id;
@@ -954,7 +1563,7 @@ namespace pizzalend {
       int64_t risk_amount = collateral.amount * liqdt_bonus / (1 + liqdt_bonus) / 3;
       asset risk_fund = asset(risk_amount, collateral.symbol);
       if (risk_fund.amount > 0) {
-        _transfer_out(SAFU_ACCOUNT, collateral_contract, risk_fund, "safe asset fund for users");
+        _accrue(SAFU_ACCOUNT, collateral_contract, risk_fund);
       }
 
       liqdtorders.emplace(_self, [&](auto& row) {
@@ -968,75 +1577,403 @@ namespace pizzalend {
       _log_liqdt(account, collateral_contract, collateral, loan_contract, loan);
     };
 
+    // protocol-owned funds waiting to be swept, scope: recipient
+    // scope _self holds the total over all recipients and is never swept
+    struct [[eosio::table]] accrual {
+      uint64_t id;
+      extended_asset quantity;
+      uint64_t updated_at;
+
+      uint128_t by_sym() const {
+        return raw(quantity.get_extended_symbol());
+      }
+
+      uint64_t primary_key() const { return id; }
+    };
+
+    typedef eosio::multi_index<
+      name("accrual"), accrual,
+      indexed_by<name("bysym"), const_mem_fun<accrual, uint128_t, &accrual::by_sym>>
+    > accrual_tlb;
+
+    void _accrue(name recipient, name contract, asset quantity) {
+      _add_accrual(recipient, contract, quantity);
+      _add_accrual(_self, contract, quantity);
+    };
+
+    // negative once swept, never below 0 for totals that predate the _self scope
+    void _add_accrual(name scope, name contract, asset quantity) {
+      accrual_tlb accruals(_self, scope.value);
+      auto accruals_bysym = accruals.get_index<name("bysym")>();
+      auto itr = accruals_bysym.find(raw(extended_symbol(quantity.symbol, contract)));
+      if (itr == accruals_bysym.end()) {
+        if (quantity.amount <= 0) return;
+        accruals.emplace(_self, [&](auto& row) {
+          row.id = accruals.available_primary_key();
+          row.quantity = extended_asset(quantity, contract);
+          row.updated_at = current_millis();
+        });
+      } else {
+        accruals_bysym.modify(itr, _self, [&](auto& row) {
+          row.quantity.quantity.amount = std::max(row.quantity.quantity.amount + quantity.amount, (int64_t)0);
+          row.updated_at = current_millis();
+        });
+      }
+    };
+
+    // held in custody for all recipients until the next sweep
+    asset _get_accrued(extended_symbol sym) {
+      accrual_tlb accruals(_self, _self.value);
+      auto accruals_bysym = accruals.get_index<name("bysym")>();
+      auto itr = accruals_bysym.find(raw(sym));
+      return itr == accruals_bysym.end() ? asset(0, sym.get_symbol()) : itr->quantity.quantity;
+    };
+
+    std::string _accrual_memo(name recipient) {
+      if (recipient == FEE_ACCOUNT) return "loan fee";
+      if (recipient == SAFU_ACCOUNT) return "safe asset fund for users";
+      return "system income";
+    };
+
+    // funds held for the account inside the protocol, custody stays with CAPITAL_ACCOUNT
+    // scope: account, scope _self holds the total over all accounts
+    struct [[eosio::table]] balance {
+      uint64_t id;
+      extended_asset quantity;
+      uint64_t updated_at;
+
+      uint128_t by_sym() const {
+        return raw(quantity.get_extended_symbol());
+      }
+
+      uint64_t primary_key() const { return id; }
+    };
+
+    typedef eosio::multi_index<
+      name("balance"), balance,
+      indexed_by<name("bysym"), const_mem_fun<balance, uint128_t, &balance::by_sym>>
+    > balance_tlb;
+
+    void _credit_balance(name account, name contract, asset quantity) {
+      check(quantity.amount > 0, "balance quantity must be positive");
+      balance_tlb balances(_self, account.value);
+      auto balances_bysym = balances.get_index<name("bysym")>();
+      auto itr = balances_bysym.find(raw(extended_symbol(quantity.symbol, contract)));
+      if (itr == balances_bysym.end()) {
+        balances.emplace(_self, [&](auto& row) {
+          row.id = balances.available_primary_key();
+          row.quantity = extended_asset(quantity, contract);
+          row.updated_at = current_millis();
+        });
+        _log_balance(account, contract, quantity);
+      } else {
+        balances_bysym.modify(itr, _self, [&](auto& row) {
+          row.quantity.quantity += quantity;
+          row.updated_at = current_millis();
+        });
+        _log_balance(account, contract, itr->quantity.quantity);
+      }
+      _add_balance_total(contract, quantity);
+    };
+
+    void _debit_balance(name account, name contract, asset quantity) {
+      check(quantity.amount > 0, "balance quantity must be positive");
+      balance_tlb balances(_self, account.value);
+      auto balances_bysym = balances.get_index<name("bysym")>();
+      auto itr = balances_bysym.find(raw(extended_symbol(quantity.symbol, contract)));
+      check(itr != balances_bysym.end() && itr->quantity.quantity >= quantity, "insufficient balance");
+      if (itr->quantity.quantity == quantity) {
+        balances_bysym.erase(itr);
+        _log_balance(account, contract, asset(0, quantity.symbol));
+      } else {
+        balances_bysym.modify(itr, _self, [&](auto& row) {
+          row.quantity.quantity -= quantity;
+          row.updated_at = current_millis();
+        });
+        _log_balance(account, contract, itr->quantity.quantity);
+      }
+      _add_balance_total(contract, -quantity);
+    };
+
+    void _add_balance_total(name contract, asset quantity) {
+      balance_tlb balances(_self, _self.value);
+      auto balances_bysym = balances.get_index<name("bysym")>();
+      auto itr = balances_bysym.find(raw(extended_symbol(quantity.symbol, contract)));
+      if (itr == balances_bysym.end()) {
+        if (quantity.amount <= 0) return;
+        balances.emplace(_self, [&](auto& row) {
+          row.id = balances.available_primary_key();
+          row.quantity = extended_asset(quantity, contract);
+          row.updated_at = current_millis();
+        });
+      } else {
+        balances_bysym.modify(itr, _self, [&](auto& row) {
+          row.quantity.quantity.amount = std::max(row.quantity.quantity.amount + quantity.amount, (int64_t)0);
+          row.updated_at = current_millis();
+        });
+      }
+    };
+
+    // held in custody for all accounts
+    asset _get_balance_total(extended_symbol sym) {
+      balance_tlb balances(_self, _self.value);
+      auto balances_bysym = balances.get_index<name("bysym")>();
+      auto itr = balances_bysym.find(raw(sym));
+      return itr == balances_bysym.end() ? asset(0, sym.get_symbol()) : itr->quantity.quantity;
+    };
+
     struct [[eosio::table]] cached_health {
       name account;
       double loan_value;
       double collateral_value;
       double factor;
       uint64_t updated_at;
+      // valuation epoch of the values above, 0 once positions changed
+      binary_extension<uint64_t> price_epoch;
+      binary_extension<double> loanable_value;
+      // per-token values at refresh, health can be projected without reading positions
+      binary_extension<std::vector<health_exposure>> exposures;
+      // positions held when health was cached
+      binary_extension<uint16_t> collateral_count;
+      binary_extension<uint16_t> loan_count;
+      // highest annual rate any of the loans can accrue at until the next refresh
+      binary_extension<double> max_rate;
+      // config version of the values above, 0 once positions changed
+      binary_extension<uint64_t> config_version;
       
       uint64_t primary_key() const { return account.value; }
 
-      bool should_refresh(uint64_t now, double threshold = 0) const {
+      // positions and token configs are as they were at the refresh
+      bool is_current(uint64_t version) const {
+        return config_version.has_value() && config_version.value() == version;
+      };
+
+      bool is_valued(uint64_t epoch, uint64_t version) const {
+        return epoch > 0 && price_epoch.has_value() && price_epoch.value() == epoch && is_current(version);
+      };
+
+      bool should_refresh(uint64_t now, uint32_t interval, double threshold = 0) const {
         if (threshold > 0 && factor > threshold) {
           return false;
         }
         if (now <= updated_at) return false;
         uint64_t passed_secs = (now - updated_at) / 1000;
-        if (factor < 1.25) return passed_secs >= 360;
-        if (factor < 1.5) return passed_secs >= 900;
-        if (factor < 1.7) return passed_secs >= 4200;
-        if (factor < 2) return passed_secs >= 6000;
-        return passed_secs >= 15000;
+        return passed_secs >= interval;
       };
     };
 
     typedef eosio::multi_index<name("cachedhealth"), cached_health> cached_health_tlb;
     cached_health_tlb cached_healths;
 
+    // the fixed tiers used before volatility scaling, an upper bound on any computed interval
+    static uint32_t _tier_refresh_interval(double factor) {
+      if (factor < 1.25) return 360;
+      if (factor < 1.5) return 900;
+      if (factor < 1.7) return 4200;
+      if (factor < 2) return 6000;
+      return 15000;
+    };
+
+    uint32_t _cal_refresh_interval(const cached_health& row, const arena_map<name, double>& vols, const refresh_policy& policy);
+
+    struct health_snapshot {
+      uint64_t epoch;
+      uint64_t config_version;
+      refresh_policy policy;
+      arena_map<name, decimal> prices;
+      arena_map<name, double> vols;
+    };
+
+    void _snapshot_healths(health_snapshot& snapshot);
+
+    // due by its refresh interval and not provably safe at current prices
+    bool _is_health_due(const cached_health& row, const health_snapshot& snapshot, uint64_t now, double threshold);
+
     void _cache_health(name account) {
-      double loan_value = _cal_loan_value(account);
-      if (loan_value <= 0) {
-        _uncache_health(account);
-        return;
-      }
+      _cache_health(account, _cal_health_detail(account));
+    };
 
-      double collateral_value = _cal_collateral_value(account);
-      double factor = collateral_value/loan_value;
-      _cache_health(account, loan_value, collateral_value, factor);
+    // positions changed, cached values can no longer be reused by user actions
+    void _invalidate_health(name account) {
+      auto itr = cached_healths.find(account.value);
+      if (itr == cached_healths.end()) return;
+      if (!itr->price_epoch.has_value() || itr->price_epoch.value() == 0) return;
+      cached_healths.modify(itr, _self, [&](auto& row) {
+        row.price_epoch = 0;
+        if (row.config_version.has_value()) {
+          row.config_version = 0;
+        }
+      });
+    };
+
+    // rows of cachedhealth still in the v1 layout, without the binary extensions
+    // readers already treat missing extensions as unknown, nothing is gated on v2
+    uint32_t _migrate_cached_health(uint64_t& cursor, bool& done, uint32_t limit, uint32_t& scanned);
+
+    // keeps the position counters of the cached row in step between refreshes
+    void _count_position(name account, bool is_collateral, int32_t delta) {
+      auto itr = cached_healths.find(account.value);
+      if (itr == cached_healths.end() || !itr->collateral_count.has_value() || !itr->loan_count.has_value()) return;
+      cached_healths.modify(itr, _self, [&](auto& row) {
+        uint16_t& count = is_collateral ? row.collateral_count.value() : row.loan_count.value();
+        count = delta < 0 && count < -delta ? 0 : count + delta;
+      });
     };
 
     void _uncache_health(name account) {
       auto itr = cached_healths.find(account.value);
       if (itr != cached_healths.end()) {
+        TRACE_COUNT(writes, 1);
+        _update_histogram(&*itr, 0, 0);
         cached_healths.erase(itr);
       }
     };
 
-    void _cache_health(name account, double loan_value, double collateral_value, double factor) {
-      if (loan_value <= 0) {
+    // fixed-bucket histogram of cached health factors, kept in step with cachedhealth
+    struct [[eosio::table]] health_hist {
+      std::vector<health_bucket> buckets;
+      uint64_t updated_at;
+
+      uint64_t primary_key() const { return 0; }
+    };
+    typedef eosio::multi_index<name("healthhist"), health_hist> healthhist_tlb;
+    healthhist_tlb health_hists;
+    // set while cachehealth rebuilds the histogram as a whole, row updates are skipped
+    bool histogram_deferred = false;
+
+    // moves the removed row out of its bucket and adds the new values, loan_value <= 0 adds nothing
+    void _update_histogram(const cached_health* removed, double factor, double loan_value);
+    void _rebuild_histogram();
+
+    void _cache_health(name account, const health_detail& detail) {
+      if (detail.loan_value <= 0) {
         _uncache_health(account);
         return;
       }
+      TRACE_COUNT(writes, 1);
+      price_state state = _get_price_state();
+      std::vector<health_exposure> exposures(detail.exposures.begin(), detail.exposures.end());
       auto itr = cached_healths.find(account.value);
       if (itr == cached_healths.end()) {
+        _update_histogram(nullptr, detail.factor(), detail.loan_value);
         cached_healths.emplace(_self, [&](auto& row) {
           row.account = account;
-          row.loan_value = loan_value;
-          row.collateral_value = collateral_value;
-          row.factor = factor;
+          row.loan_value = detail.loan_value;
+          row.collateral_value = detail.collateral_value;
+          row.factor = detail.factor();
           row.updated_at = current_millis();
+          row.price_epoch = state.epoch;
+          row.loanable_value = detail.loanable_value;
+          row.exposures = exposures;
+          row.collateral_count = detail.collateral_count;
+          row.loan_count = detail.loan_count;
+          row.max_rate = detail.max_rate;
+          row.config_version = state.config_version;
         });
       } else {
+        _update_histogram(&*itr, detail.factor(), detail.loan_value);
         cached_healths.modify(itr, _self, [&](auto& row) {
-          row.loan_value = loan_value;
-          row.collateral_value = collateral_value;
-          row.factor = factor;
+          row.loan_value = detail.loan_value;
+          row.collateral_value = detail.collateral_value;
+          row.factor = detail.factor();
           row.updated_at = current_millis();
+          row.price_epoch = state.epoch;
+          row.loanable_value = detail.loanable_value;
+          row.exposures = exposures;
+          row.collateral_count = detail.collateral_count;
+          row.loan_count = detail.loan_count;
+          row.max_rate = detail.max_rate;
+          row.config_version = state.config_version;
         });
       }
     };
 
+    // the factor under current prices cannot have dropped, no need to read positions
+    bool _is_provably_safe(const cached_health& row, const health_snapshot& snapshot, uint64_t now) {
+      // positions and token configs are as they were at the refresh, prices may have moved since
+      if (!row.is_current(snapshot.config_version)) return false;
+      if (!row.exposures.has_value() || row.exposures->empty() || !row.max_rate.has_value()) return false;
+      if (now - row.updated_at >= (uint64_t)SENSITIVITY_MAX_AGE * 1000) return false;
+
+      double collateral_value = 0;
+      double loan_value = 0;
+      for (auto itr = row.exposures->begin(); itr != row.exposures->end(); itr++) {
+        auto price = snapshot.prices.find(itr->pzname);
+        if (price == snapshot.prices.end() || itr->price.amount <= 0) return false;
+        double ratio = decimal2double(price->second) / decimal2double(itr->price);
+        collateral_value += itr->collateral_value * ratio;
+        loan_value += itr->loan_value * ratio;
+      }
+      if (loan_value <= 0) return false;
+
+      // interest the loans may have accrued since the refresh, not settled into the epoch yet
+      double passed_secs = (now - row.updated_at) / 1000;
+      loan_value *= 1 + row.max_rate.value() * passed_secs / SECONDS_PER_YEAR;
+
+      double factor = collateral_value/loan_value;
+      return factor >= SENSITIVITY_MIN_FACTOR && factor >= row.factor * (1 - SENSITIVITY_MARGIN);
+    };
+
+    // accounts to refresh first in the next uphealth
+    struct [[eosio::table]] dirty_health {
+      name account;
+      uint64_t marked_at;
+
+      uint64_t primary_key() const { return account.value; }
+    };
+    typedef eosio::multi_index<name("dirtyhealth"), dirty_health> dirtyhealth_tlb;
+
+    void _mark_dirty(name account) {
+      if (cached_healths.find(account.value) == cached_healths.end()) return;
+
+      dirtyhealth_tlb dirtyhealths(_self, _self.value);
+      if (dirtyhealths.find(account.value) != dirtyhealths.end()) return;
+      dirtyhealths.emplace(_self, [&](auto& row) {
+        row.account = account;
+        row.marked_at = current_millis();
+      });
+    };
+
+    // after a user action: new accounts are cached right away, known ones are
+    // already invalidated and get their full refresh from the next sweep
+    void _defer_health(name account) {
+      if (cached_healths.find(account.value) == cached_healths.end()) {
+        _cache_health(account);
+        return;
+      }
+      _mark_dirty(account);
+    };
+
+    enum ExposureSide {
+      NoSide = 0,
+      // price dropped, collateral holders are at risk
+      CollateralSide = 1,
+      // price rose, borrowers are at risk
+      LoanSide = 2
+    };
+
+    // price at which the holders of a pztoken were last marked dirty
+    struct [[eosio::table]] exposure {
+      name pzname;
+      decimal marked_price;
+      uint8_t pending_side;
+      // id of the next collateral/loan to mark, 0 to start over
+      uint64_t cursor;
+
+      uint64_t primary_key() const { return pzname.value; }
+    };
+    typedef eosio::multi_index<name("exposure"), exposure> exposure_tlb;
+
+    // old_price is the baseline for tokens not tracked yet
+    void _on_price_changed(name pzname, decimal old_price, decimal price);
+
+    // return:
+    //   collateral/loan rows marked, at most limit
+    uint32_t _mark_exposed(exposure_tlb& exposures, exposure_tlb::const_iterator itr, uint32_t limit = EXPOSURE_MARK_LIMIT);
+
+    // rows _mark_exposed would still visit from the token's cursor, at most limit
+    uint32_t _count_exposed(exposure_tlb::const_iterator itr, uint32_t limit);
+
     struct [[eosio::table]] baddebt {
       name pzname;
       extended_asset quantity;
@@ -1047,7 +1984,7 @@ namespace pizzalend {
     typedef eosio::multi_index<name("baddebt"), baddebt> baddebt_tlb;
     baddebt_tlb baddebts;
 
-    void _incr_baddebt(pztoken pz, asset quantity) {
+    void _incr_baddebt(const pztoken& pz, asset quantity) {
       auto itr = baddebts.find(pz.pzname.value);
       if (itr == baddebts.end()) {
         baddebts.emplace(_self, [&](auto& row) {
@@ -1062,6 +1999,7 @@ namespace pizzalend {
       }
     };
 
+    // replaced by pztoken.stable_weight, rows are erased when their pztoken is settled
     struct [[eosio::table]] cached_stable {
       name pzname;
       double interest;
@@ -1071,71 +2009,25 @@ namespace pizzalend {
     };
 
     typedef eosio::multi_index<name("cachedstable"), cached_stable> cachedstable_tlb;
-    cachedstable_tlb cachedstables;
-
-    void _change_stable_interest(name pzname, double delta) {
-      auto itr = cachedstables.find(pzname.value);
-      if (itr == cachedstables.end()) {
-        itr = cachedstables.emplace(_self, [&](auto& row) {
-          row.pzname = pzname;
-          row.interest = delta;
-          row.updated_at = current_millis();
-        });
-      } else {
-        cachedstables.modify(itr, _self, [&](auto& row) {
-          row.interest += delta;
-          row.updated_at = current_millis();
-        });
-      }
-      check(itr->interest >= 0, "cached stable interest must be positive");
-    };
 
-    void _cache_stable(name pzname, double interest) {
-      auto itr = cachedstables.find(pzname.value);
-      if (itr == cachedstables.end()) {
-        cachedstables.emplace(_self, [&](auto& row) {
-          row.pzname = pzname;
-          row.interest = interest;
-          row.updated_at = current_millis();
-        });
-      } else {
-        cachedstables.modify(itr, _self, [&](auto& row) {
-          row.interest = interest;
-          row.updated_at = current_millis();
-        });
-      }
+    void _change_stable_weight(name pzname, uint128_t old_weight, uint128_t new_weight) {
+      auto itr = pztokens.find(pzname.value);
+      check(itr != pztokens.end(), "pztoken not found");
+      // not tracked yet, _recal_pztoken sums it from the loans
+      if (!itr->stable_weight.has_value()) return;
+      check(itr->stable_weight.value() + new_weight >= old_weight, "stable weight underflow");
+      pztokens.modify(itr, _self, [&](auto& row) {
+        row.stable_weight = row.stable_weight.value() + new_weight - old_weight;
+      });
     };
 
-    double _get_stable_interest(name pzname) {
-      auto itr = cachedstables.find(pzname.value);
-      if (itr != cachedstables.end()) {
-        return itr->interest;
-      }
-
-      pztoken pz = pztokens.get(pzname.value, "pztoken not found");
-      double stable_interest = 0;
+    uint128_t _sum_stable_weight(name pzname) {
+      uint128_t stable_weight = 0;
       auto loans_bypzname = loans.get_index<name("bypzname")>();
-      auto loan_itr = loans_bypzname.lower_bound(pzname.value);
-      while(loan_itr != loans_bypzname.end() && loan_itr->pzname == pzname) {
-        if (loan_itr->type == BorrowType::Stable) {
-          stable_interest += decimal2double(loan_itr->fixed_rate) * asset2double(loan_itr->quantity);
-        }
-        loan_itr++;
-      }
-
-      if (itr == cachedstables.end()) {
-        itr = cachedstables.emplace(_self, [&](auto& row) {
-          row.pzname = pzname;
-          row.interest = stable_interest;
-          row.updated_at = current_millis();
-        });
-      } else {
-        cachedstables.modify(itr, _self, [&](auto& row) {
-          row.interest = stable_interest;
-          row.updated_at = current_millis();
-        });
+      for (auto itr = loans_bypzname.lower_bound(pzname.value); itr != loans_bypzname.end() && itr->pzname == pzname; itr++) {
+        stable_weight += itr->stable_weight();
       }
-      return stable_interest;
+      return stable_weight;
     };
 
     struct [[eosio::table]] earn {
@@ -1260,11 +2152,55 @@ namespace pizzalend {
         if (_in_blocklist(account, feature)) return true;
       }
 
+      // not cached, an account that passed once could deploy code and slip through until expiry
       if (is_contract(account)) return true;
 
       return false;
     };
 
+    enum VoteTier {
+      NoVote = 0,
+      FeeWaiver = 1
+    };
+
+    // cached vote tier, saves reading vote.pizza tables, expired rows are erased by gc
+    struct [[eosio::table]] eligibility {
+      name account;
+      uint8_t vote_tier;
+      uint64_t expired_at;
+
+      uint64_t primary_key() const { return account.value; }
+    };
+    typedef eosio::multi_index<name("eligibility"), eligibility> eligibility_tlb;
+
+    eligibility _get_eligibility(name account, bool dry_run = false, bool force = false) {
+      eligibility_tlb eligibilities(_self, _self.value);
+      auto itr = eligibilities.find(account.value);
+      uint64_t now = current_millis();
+      if (!force && itr != eligibilities.end() && itr->expired_at > now) {
+        return *itr;
+      }
+
+      eligibility elig;
+      elig.account = account;
+      elig.vote_tier = votepower::get_votes(account) >= FEE_WAIVER_VOTES ? VoteTier::FeeWaiver : VoteTier::NoVote;
+      elig.expired_at = now + ELIGIBILITY_TTL * 1000;
+      if (dry_run) {
+        return elig;
+      }
+
+      if (itr == eligibilities.end()) {
+        eligibilities.emplace(_self, [&](auto& row) {
+          row = elig;
+        });
+      } else {
+        eligibilities.modify(itr, _self, [&](auto& row) {
+          row = elig;
+        });
+      }
+      return elig;
+    };
+
     struct [[eosio::table]] defendlist {
       name token;
       uint8_t pool_size;
@@ -1315,14 +2251,14 @@ namespace pizzalend {
 
         pools.push_back(quantity);
 
-        std::vector<asset> tempPools(pools);
-        std::sort(tempPools.begin(), tempPools.end());
+        arena_vector<asset> tempPools(pools.begin(), pools.end());
+        insertion_sort(tempPools.begin(), tempPools.end());
         auto mid = tempPools[tempPools.size()/2];
 
         auto pause_time = itr->pause_at;
         if (delta.amount > 0){
 
-          pztoken pz = pztokens.get(token.value);
+          const pztoken& pz = pztokens.get(token.value);
           auto value = decimal2double(pz.price) * pz.cal_pzprice() * asset2double(delta);
 
           if (value >= asset2double(itr->pause_value)){
@@ -1343,6 +2279,10 @@ namespace pizzalend {
     }
 
     bool _defend_borrow_check(name account, double value){
+      return value <= _cal_defend_value(account);
+    }
+
+    double _cal_defend_value(name account){
 
       defendlist_tlb defendlist(_self, ALL.value);
 
@@ -1352,7 +2292,7 @@ namespace pizzalend {
       auto itr = collaterals_byacc.lower_bound(account.value);
 
       while(itr != collaterals_byacc.end() && itr->account == account) {
-        pztoken pz = pztokens.get(itr->pzname.value);
+        const pztoken& pz = pztokens.get(itr->pzname.value);
         auto defend = defendlist.find(itr->pzname.value);
 
         decimal rate = pz.config.max_ltv;
@@ -1379,7 +2319,7 @@ namespace pizzalend {
         itr++;
       }
 
-      return value < defend_value;
+      return defend_value;
     }
 
     void _update_defend(name token, asset max_value, asset pause_value, uint8_t percent, uint8_t pool_size){
@@ -1411,9 +2351,30 @@ namespace pizzalend {
       });
     }
 
+    #ifndef MAINNET
+    // rows are unpacked one by one, trailing binary extensions would otherwise read into the next row
+    template <typename Table, typename Row, typename OnLoad>
+    uint32_t _bulkload(Table& table, const std::vector<std::vector<char>>& rows, OnLoad on_load) {
+      uint32_t count = 0;
+      for (auto itr = rows.begin(); itr != rows.end(); itr++) {
+        datastream<const char*> ds(itr->data(), itr->size());
+        Row row;
+        ds >> row;
+        check(ds.remaining() == 0, "row has trailing bytes");
+        check(table.find(row.primary_key()) == table.end(), "row already exists");
+        on_load(row);
+        table.emplace(_self, [&](auto& r) {
+          r = row;
+        });
+        count++;
+      }
+      return count;
+    };
+    #endif
+
     void _deposit(name account, name contract, asset quantity);
 
-    void _collateral(name account, name contract, asset quantity);
+    void _collateral(name account, name contract, asset quantity, bool from_balance = false);
 
     void _redeem(name account, name pzcontract, asset pzquantity);
 
@@ -1421,11 +2382,13 @@ namespace pizzalend {
 
     void _withdraw_pztoken(name account, name pzcontract, asset pzquantity);
 
-    decimal _borrow(name account, name contract, asset quantity, uint8_t type, decimal fee_deduct = decimal(0, FLOAT));
+    decimal _borrow(name account, name contract, asset quantity, uint8_t type, decimal fee_deduct = decimal(0, FLOAT), bool to_balance = false);
 
     void _borrow_with_fee(name account, name fee_contract, asset fee_quantity, memo m);
 
-    void _repay(name account, name contract, asset quantity);
+    void _repay(name account, name contract, asset quantity, bool from_balance = false);
+
+    void _deposit_balance(name account, name contract, asset quantity);
 
     void _mini_repay(name account, name contract, asset quantity, memo m);
 
@@ -1439,15 +2402,48 @@ namespace pizzalend {
 
     void _liqdt(name account, double remain_loan_value);
 
-    struct acc_value {
-      double loan_value;
-      double collateral_value;
+    enum GcCategory {
+      DustCollateral = 0,
+      DustLoan = 1,
+      DrainedOrder = 2,
+      ExpiredAllow = 3,
+      ExpiredBlock = 4,
+      ExpiredEligibility = 5,
+      GcCategoryCount = 6
+    };
 
-      acc_value() : loan_value(0), collateral_value(0) {}
+    // cursor and progress of the gc sweep
+    struct [[eosio::table]] gc_state {
+      uint8_t category;
+      uint8_t scope_index;
+      uint64_t cursor;
+      uint64_t dust_collaterals;
+      uint64_t dust_loans;
+      uint64_t drained_orders;
+      uint64_t expired_lists;
+      uint64_t expired_eligibilities;
+      uint64_t updated_at;
 
-      acc_value(double l, double c) {
-        loan_value = l;
-        collateral_value = c;
+      uint64_t primary_key() const { return 0; }
+    };
+    typedef eosio::multi_index<name("gcstate"), gc_state> gcstate_tlb;
+
+    // dust swept to SAFU, settled once per gc run
+    typedef arena_map<extended_symbol, asset> dust_map;
+
+    bool _gc_collaterals(gc_state& state, uint32_t& budget, dust_map& dusts);
+    bool _gc_loans(gc_state& state, uint32_t& budget);
+    bool _gc_liqdtorders(gc_state& state, uint32_t& budget, dust_map& dusts);
+    bool _gc_allowlist(gc_state& state, uint32_t& budget);
+    bool _gc_blocklist(gc_state& state, uint32_t& budget);
+    bool _gc_eligibilities(gc_state& state, uint32_t& budget);
+
+    void _add_dust(dust_map& dusts, extended_symbol sym, asset quantity) {
+      auto itr = dusts.find(sym);
+      if (itr == dusts.end()) {
+        dusts[sym] = quantity;
+      } else {
+        itr->second += quantity;
       }
     };
   };
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# Exports contract tables as bulkload chunks for a testnet deployment.
+#
+#   tools/bulkexport.py --url https://eos.greymass.com --table loans > loans.jsonl
+#   while read -r args; do cleos push action lendtest1111 bulkload "$args" -p lendtest1111; done < loans.jsonl
+#
+# Load pztokens first, the other tables look their pztoken up while loading.
+
+import argparse
+import json
+import sys
+import urllib.request
+
+# bulkload table argument -> on-chain table name
+TABLES = {
+    "pztokens": "pztoken",
+    "collaterals": "collateral",
+    "loans": "loan",
+    "cachedhealth": "cachedhealth",
+}
+
+
+def fetch_rows(url, contract, table, page):
+    lower_bound = ""
+    while True:
+        body = {
+            "code": contract,
+            "scope": contract,
+            "table": table,
+            "json": False,
+            "limit": page,
+            "lower_bound": lower_bound,
+        }
+        req = urllib.request.Request(url.rstrip("/") + "/v1/chain/get_table_rows", data=json.dumps(body).encode(),
+                                     headers={"Content-Type": "application/json"})
+        with urllib.request.urlopen(req) as resp:
+            result = json.load(resp)
+        # json=false returns each row packed in table layout as hex
+        for row in result["rows"]:
+            yield row if isinstance(row, str) else row["data"]
+        if not result.get("more") or not result.get("next_key"):
+            return
+        lower_bound = result["next_key"]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="export bulkload chunks, one action argument per line")
+    parser.add_argument("--url", required=True, help="nodeos http endpoint")
+    parser.add_argument("--contract", default="lend.pizza")
+    parser.add_argument("--table", required=True, choices=sorted(TABLES))
+    parser.add_argument("--chunk", type=int, default=200, help="rows per bulkload action")
+    parser.add_argument("--page", type=int, default=1000, help="rows per get_table_rows call")
+    args = parser.parse_args()
+
+    chunk = []
+    for row in fetch_rows(args.url, args.contract, TABLES[args.table], args.page):
+        chunk.append(row)
+        if len(chunk) >= args.chunk:
+            print(json.dumps({"table": args.table, "rows": chunk}))
+            chunk = []
+    if chunk:
+        print(json.dumps({"table": args.table, "rows": chunk}))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
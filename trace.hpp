@@ -0,0 +1,46 @@
+#pragma once
+
+#include "common.hpp"
+
+// 0: off, nothing below generates code
+// 1: info, rare events such as liquidations
+// 2: debug, per-row details in hot paths plus the counters
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 0
+#endif
+
+#if TRACE_LEVEL >= 1
+#define TRACE_INFO(...) print_f(__VA_ARGS__)
+#else
+#define TRACE_INFO(...) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= 2
+#define TRACE_DEBUG(...) print_f(__VA_ARGS__)
+#define TRACE_COUNT(field, n) (trace::current.field += (n))
+#define TRACE_PHASE(phase) trace::flush(phase)
+#else
+#define TRACE_DEBUG(...) ((void)0)
+#define TRACE_COUNT(field, n) ((void)0)
+#define TRACE_PHASE(phase) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= 2
+// work done since the last phase of the running action
+namespace trace {
+  struct counters {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t scans;
+    uint32_t actions;
+  };
+
+  counters current = {};
+
+  // one line per phase, e.g. "trace uphealth.sweep reads=120 writes=40 scans=2 actions=0 | "
+  void flush(const char* phase) {
+    print_f("trace % reads=% writes=% scans=% actions=% | ", phase, current.reads, current.writes, current.scans, current.actions);
+    current = {};
+  };
+}
+#endif
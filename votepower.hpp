@@ -17,9 +17,9 @@ namespace votepower {
   };
 
   typedef eosio::multi_index<name("voter"), voter> voter_tlb;
-  voter_tlb voters(VOTE_ACCOUNT, VOTE_ACCOUNT.value);
 
   uint64_t get_votes(name account) {
+    voter_tlb voters(VOTE_ACCOUNT, VOTE_ACCOUNT.value);
     auto itr = voters.find(account.value);
     if (itr != voters.end()) {
       return itr->votes;